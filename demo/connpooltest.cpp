@@ -0,0 +1,132 @@
+#include "async/Runtime.hpp"
+#include "async/Tasks.hpp"
+#include "async/Timer.hpp"
+#include "async/Uring.hpp"
+#include "http/Socket.hpp"
+#include "uring/ConnectionPool.hpp"
+#include "uring/Socket.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <format>
+#include <memory>
+#include <print>
+#include <string>
+#include <string_view>
+
+using namespace ACPAcoro;
+using namespace std::chrono_literals;
+
+// checks of the io_uring client side over loopback
+//
+// a connection is made through connectionPool, released and acquired
+// again, which must hand out the same socket without a new accept. once
+// the server closed it, the idle socket is dropped and a new one is made.
+// the resolver errors must keep their EAI_* code.
+// exit with the number of failed checks
+
+auto &threadPoolInst = threadPool::getInstance();
+uringInstance uringInst{threadPoolInst};
+std::atomic<int> accepted = 0;
+int failures = 0;
+
+void check(bool ok, std::string const &what) {
+  if (!ok) {
+    failures++;
+    std::println("FAILED: {}", what);
+  }
+}
+
+// echo what's received, "bye" closes the connection
+Task<> echo(int fd) {
+  accepted++;
+  asyncSocket client(fd);
+  char buf[64];
+  while (true) {
+    auto recvRes = co_await client.recv(buf, sizeof(buf), 0, uringInst);
+    if (!recvRes && recvRes.error() == make_error_code(uringErr::sqeBusy)) {
+      co_await threadPoolInst.scheduler;
+      continue;
+    }
+    if (!recvRes || recvRes.value() == 0) {
+      co_return;
+    }
+    std::string_view message(buf, recvRes.value());
+    if (message == "bye") {
+      co_return;
+    }
+    co_await client.send(buf, message.size(), 0, uringInst);
+  }
+}
+
+// send the message and wait for its echo
+Task<bool> roundTrip(asyncClientSocket &sock, std::string_view message) {
+  auto sendRes =
+      co_await sock.send(message.data(), message.size(), 0, uringInst);
+  if (!sendRes) {
+    co_return false;
+  }
+  char buf[64];
+  auto recvRes = co_await sock.recv(buf, sizeof(buf), 0, uringInst);
+  co_return recvRes && std::string_view(buf, recvRes.value()) == message;
+}
+
+Task<> checks(std::string const &port) {
+  connectionPool pool(uringInst);
+  endpoint local{"127.0.0.1", port};
+
+  auto first = co_await pool.acquire(local);
+  check(first.has_value(), "connect over loopback");
+  if (!first) {
+    co_return;
+  }
+  check(co_await roundTrip(**first, "ping"), "echo on a new connection");
+  auto fd = (*first)->fd;
+  pool.release(std::move(*first));
+
+  auto again = co_await pool.acquire(local);
+  check(again && (*again)->fd == fd && accepted == 1,
+        "reacquire the idle connection");
+  if (!again) {
+    co_return;
+  }
+  check(co_await roundTrip(**again, "pong"), "echo on a reused connection");
+
+  // the server closes it while it's idle
+  co_await (*again)->send("bye", 3, 0, uringInst);
+  pool.release(std::move(*again));
+  co_await sleepFor(50ms);
+
+  auto fresh = co_await pool.acquire(local);
+  check(fresh && co_await roundTrip(**fresh, "new") && accepted == 2,
+        "drop an idle connection closed by the peer");
+
+  // .invalid never resolves, the error keeps the EAI_* code whether the
+  // lookup fails with EAI_NONAME or without network with EAI_AGAIN
+  endpoint nowhere{"no-such-host.invalid", port};
+  auto unresolved = co_await asyncClientSocket::connect(nowhere, uringInst);
+  check(!unresolved && unresolved.error().category() == resolveErrorCode(),
+        std::format("resolver error: {}",
+                    unresolved ? "connected" : unresolved.error().message()));
+}
+
+int main(int argc, char *argv[]) {
+  std::string port = argc < 2 ? "12313" : argv[1];
+
+  runtime rt(threadPoolInst);
+
+  auto server = std::make_unique<serverSocket>(port);
+  server->listen();
+  auto onAccept = [](int fd) { return echo(fd); };
+  threadPoolInst.spawn(
+      uringInst.reapIOs<multishotAcceptAwaiter<decltype(onAccept)>>()
+          .detach());
+  threadPoolInst.spawn(
+      asyncAccept(std::move(server), onAccept, uringInst).detach());
+
+  rt.blockOn(checks(port));
+  rt.stop();
+
+  std::println("{} failed checks", failures);
+  return failures;
+}
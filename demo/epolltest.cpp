@@ -2,6 +2,7 @@
 #include "async/Epoll.hpp"
 
 #include "async/Loop.hpp"
+#include "async/Runtime.hpp"
 #include "async/Tasks.hpp"
 #include "http/Socket.hpp"
 #include "tl/expected.hpp"
@@ -45,7 +46,9 @@ Task<> writer(std::shared_ptr<reactorSocket> socket,
               make_error_code(std::errc::resource_unavailable_try_again) ||
           sendResult.error() ==
               make_error_code(std::errc::operation_would_block)) {
-        co_await threadPoolInst.scheduler;
+        if (!co_await socket->writable()) {
+          co_return;
+        }
       } else {
         std::println("Error: {}", sendResult.error().message());
         co_return;
@@ -94,11 +97,13 @@ Task<> echoHandle(std::shared_ptr<reactorSocket> socket) {
             read.error() == make_error_code(std::errc::operation_would_block) ||
             read.error() == make_error_code(socketError::eofError)) {
 
-          threadPoolInst.addTask(
-              writer(socket, buffer, buffer->size()).detach());
+          forget(writer(socket, buffer, buffer->size()))
+              .start(threadPoolInst);
 
           if (read.error() != make_error_code(socketError::eofError)) {
-            co_await threadPoolInst.scheduler;
+            if (!co_await socket->readable()) {
+              co_return;
+            }
             break;
           } else {
             co_return;
@@ -122,23 +127,20 @@ Task<> co_main() {
   epoll_event event;
   event.events = EPOLLIN;
   event.data.ptr =
-      acceptAll(std::move(server), echoHandle, epollInst, threadPoolInst)
+      acceptAll(std::move(server), echoHandle, epollInst)
           .detach()
           .address();
 
   epollInst.addEvent(fd, &event);
 
-  threadPoolInst.addTask(epollInst.epollWaitEvent().detach());
-  threadPoolInst.enter();
+  threadPoolInst.spawn(epollInst.epollWaitEvent().detach());
 
   co_return;
 }
 
 int main() {
-  auto mainTask = co_main();
-
-  while (!mainTask.selfCoro.done()) {
-    mainTask.resume();
-  }
+  runtime rt(threadPoolInst);
+  rt.blockOn(co_main());
+  rt.wait();
   return 0;
 }
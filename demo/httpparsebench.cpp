@@ -0,0 +1,157 @@
+#include "http/Http.hpp"
+#include "http/HttpParser.hpp"
+#include "http/HttpScan.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <print>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+using namespace ACPAcoro;
+
+// time the scan of a request head: the find() based split the parser used
+// before, against httpScan. then the whole parse of httpRequest, which
+// adds the header table on top of the scan, and the framing of the head
+// by requestParser as it would be read in chunks
+
+std::string_view const requestHead =
+    "GET /static/images/a/rather/long/path/logo.png?version=42 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 "
+    "Firefox/128.0\r\n"
+    "Accept: image/avif,image/webp,image/png,image/svg+xml,image/*;q=0.8,"
+    "*/*;q=0.5\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Connection: keep-alive\r\n"
+    "Referer: https://www.example.com/index.html\r\n"
+    "Sec-Fetch-Dest: image\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "\r\n";
+
+using headerViews = std::vector<std::pair<std::string_view, std::string_view>>;
+
+// the splitting of the former parseFirstLine and parseHeaders
+bool legacyScan(std::string_view request, headerViews &headers) {
+  auto pos = request.find("\r\n");
+  if (pos == std::string_view::npos) {
+    return false;
+  }
+  auto requestLine = request.substr(0, pos);
+  request.remove_prefix(pos + 2);
+  for (int i = 0; i < 2; i++) {
+    pos = requestLine.find(' ');
+    if (pos == std::string_view::npos) {
+      return false;
+    }
+    requestLine.remove_prefix(pos + 1);
+  }
+
+  pos = request.find("\r\n");
+  while (pos != 0) {
+    if (pos == std::string_view::npos) {
+      return false;
+    }
+    auto headerLine = request.substr(0, pos);
+    request.remove_prefix(pos + 2);
+    pos = headerLine.find(':');
+    if (pos == std::string_view::npos || pos == 0) {
+      return false;
+    }
+    headers.emplace_back(headerLine.substr(0, pos),
+                         headerLine.substr(pos + 1));
+    pos = request.find("\r\n");
+  }
+  return true;
+}
+
+bool simdScan(std::string_view request, headerViews &headers) {
+  httpScan::requestLine line;
+  auto pos = httpScan::scanRequestLine(request, line);
+  if (pos == httpScan::npos) {
+    return false;
+  }
+  request.remove_prefix(pos);
+
+  httpScan::headerIndex index;
+  if (httpScan::indexHeaders(request, index) !=
+      httpScan::headStatus::complete) {
+    return false;
+  }
+  for (auto slice : index.view()) {
+    httpScan::headerLine header;
+    if (!httpScan::scanHeaderLine(request, slice, header)) {
+      return false;
+    }
+    headers.emplace_back(header.name.of(request), header.value.of(request));
+  }
+  return true;
+}
+
+bool fullParse(std::string_view request, headerViews &) {
+  httpRequest parsed;
+  return parsed.parseFirstLine(request) && parsed.parseHeaders(request);
+}
+
+// the head read 64 bytes at a time
+bool incremental(std::string_view request, headerViews &) {
+  requestParser parser;
+  for (std::size_t pos = 0; pos < request.size(); pos += 64) {
+    auto [status, leftover] = parser.feed(request.substr(pos, 64));
+    if (status != httpScan::headStatus::incomplete) {
+      return status == httpScan::headStatus::complete;
+    }
+  }
+  return false;
+}
+
+// best of a few runs, the others are disturbed by the rest of the machine
+template <typename F> void bench(char const *name, F &&parse) {
+  constexpr int rounds = 1'000'000;
+  constexpr int runs = 5;
+  headerViews headers;
+  headers.reserve(16);
+  std::size_t checksum = 0;
+  double best = 0;
+
+  for (int run = 0; run < runs; run++) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+      headers.clear();
+      // keep the compiler from hoisting the parse out of the loop
+      char const *volatile data = requestHead.data();
+      std::string_view request(data, requestHead.size());
+      checksum += parse(request, headers) + headers.size();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    auto ns =
+        std::chrono::duration<double, std::nano>(elapsed).count() / rounds;
+    if (run == 0 || ns < best) {
+      best = ns;
+    }
+  }
+
+  std::println("{:<12} {:>8.1f} ns/request  {:>8.2f} GB/s  (checksum {})",
+               name, best, requestHead.size() / best, checksum);
+}
+
+int main() {
+#if defined(__AVX2__)
+  std::println("scanner: AVX2");
+#elif defined(__SSSE3__)
+  std::println("scanner: SSSE3");
+#elif defined(__SSE2__)
+  std::println("scanner: SSE2, header names byte by byte");
+#else
+  std::println("scanner: scalar");
+#endif
+  std::println("request head: {} bytes", requestHead.size());
+
+  bench("find()", legacyScan);
+  bench("httpScan", simdScan);
+  bench("httpRequest", fullParse);
+  bench("requestParser", incremental);
+}
@@ -0,0 +1,241 @@
+#include "http/Http.hpp"
+#include "http/HttpParser.hpp"
+#include "http/HttpScan.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <format>
+#include <memory>
+#include <print>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace ACPAcoro;
+using httpScan::headStatus;
+
+// checks of the request head scanner and the resumable parser
+//
+// every stream is fed whole and in chunks of several sizes, so the
+// terminators and the runs straddle the reads, and the heads found are
+// compared with the expected status, head size and leftover bytes.
+// the SIMD paths checked are the ones of the build: run it built with
+// ACPACORO_NATIVE_ARCH=ON and OFF to cover AVX2/SSSE3 and SSE2.
+// exit with the number of failed checks
+
+int failures = 0;
+
+void check(bool ok, std::string const &what) {
+  if (!ok) {
+    failures++;
+    std::println("FAILED: {}", what);
+  }
+}
+
+struct outcome {
+  headStatus status;
+  // bytes of a complete head
+  std::size_t headSize;
+
+  bool operator==(outcome const &) const = default;
+};
+
+bool sameRequest(httpRequest const &a, httpRequest const &b) {
+  auto fa = a.headers.fields();
+  auto fb = b.headers.fields();
+  return a.method == b.method && a.uri == b.uri && a.version == b.version &&
+         std::ranges::equal(fa, fb, [](auto const &x, auto const &y) {
+           return x.name == y.name && x.value == y.value;
+         });
+}
+
+constexpr std::size_t chunkSizes[] = {1, 2, 3, 7, 16, 31, 64, 10000};
+
+// feed the stream and restart on the leftover bytes of every complete head,
+// as the readers of a connection do
+void expectHeads(std::string_view name, std::string_view stream,
+                 std::vector<outcome> const &expected) {
+  for (auto chunk : chunkSizes) {
+    std::string buffer;
+    requestParser parser;
+    std::vector<outcome> heads;
+
+    for (std::size_t pos = 0; pos < stream.size(); pos += chunk) {
+      auto piece = stream.substr(pos, chunk);
+      buffer.append(piece);
+      auto result = parser.feed(piece);
+
+      while (result.status == headStatus::complete) {
+        check(buffer.size() - parser.headSize() == result.leftover,
+              std::format("{}: leftover, chunks of {}", name, chunk));
+        heads.push_back({headStatus::complete, parser.headSize()});
+
+        // the framing and the split of the head must agree, and the
+        // bounds recorded by the parser split it as a scan of it does
+        auto head =
+            std::make_shared<std::string>(buffer.substr(0, parser.headSize()));
+        httpRequest scanned;
+        httpRequest split;
+        check(scanned.parseResquest(head).has_value(),
+              std::format("{}: parseResquest, chunks of {}", name, chunk));
+        check(split.parseResquest(head, parser).has_value() &&
+                  sameRequest(scanned, split),
+              std::format("{}: split with the parser bounds, chunks of {}",
+                          name, chunk));
+
+        buffer.erase(0, parser.headSize());
+        parser.reset();
+        result = parser.feed(buffer);
+      }
+      if (result.status == headStatus::malformed) {
+        heads.push_back({headStatus::malformed, 0});
+        break;
+      }
+    }
+
+    check(heads == expected,
+          std::format("{}: {} heads found, {} expected, chunks of {}", name,
+                      heads.size(), expected.size(), chunk));
+  }
+}
+
+outcome complete(std::string_view head) {
+  return {headStatus::complete, head.size()};
+}
+
+constexpr outcome malformed{headStatus::malformed, 0};
+
+std::string headWithFields(std::size_t count) {
+  std::string head = "GET / HTTP/1.1\r\n";
+  for (std::size_t i = 0; i < count; i++) {
+    head += std::format("X-Field-{}: {}\r\n", i, i);
+  }
+  return head + "\r\n";
+}
+
+void framing() {
+  std::string_view const simple = "GET /index.html HTTP/1.1\r\n"
+                                  "Host: www.example.com\r\n"
+                                  "\r\n";
+  std::string_view const longValues =
+      "GET /static/images/a/rather/long/path/logo.png?version=42 HTTP/1.1\r\n"
+      "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 "
+      "Firefox/128.0\r\n"
+      "Accept: image/avif,image/webp,image/png,image/svg+xml,image/*;q=0.8,"
+      "*/*;q=0.5\r\n"
+      "\r\n";
+
+  expectHeads("simple", simple, {complete(simple)});
+  expectHeads("long values", longValues, {complete(longValues)});
+
+  // nothing but the terminator is missing, then it comes
+  expectHeads("incomplete", simple.substr(0, simple.size() - 1), {});
+
+  // the next requests follow in the same reads
+  std::string pipelined = std::string(simple) + std::string(longValues) +
+                          std::string(simple.substr(0, 20));
+  expectHeads("pipelined", pipelined,
+              {complete(simple), complete(longValues)});
+
+  std::string_view const emptyValue = "GET / HTTP/1.1\r\n"
+                                      "X-Empty:\r\n"
+                                      "X-Blank: \t \r\n"
+                                      "X-Padded:\t a b \t\r\n"
+                                      "\r\n";
+  expectHeads("empty values", emptyValue, {complete(emptyValue)});
+
+  expectHeads("bare LF ending the request line", "GET / HTTP/1.1\n\r\n",
+              {malformed});
+  expectHeads("bare LF ending the head", "GET / HTTP/1.1\r\nHost: a\r\n\n",
+              {malformed});
+  expectHeads("bare CR in a value", "GET / HTTP/1.1\r\nHost: a\rb\r\n\r\n",
+              {malformed});
+  expectHeads("obs-fold", "GET / HTTP/1.1\r\nX-Folded: a\r\n b\r\n\r\n",
+              {malformed});
+  expectHeads("space before the colon",
+              "GET / HTTP/1.1\r\nHost : a\r\n\r\n", {malformed});
+  expectHeads("empty name", "GET / HTTP/1.1\r\n: a\r\n\r\n", {malformed});
+  expectHeads("empty target", "GET  HTTP/1.1\r\n\r\n", {malformed});
+  expectHeads("control byte in the target", "GET /\x01 HTTP/1.1\r\n\r\n",
+              {malformed});
+
+  auto maxFields = headWithFields(httpScan::maxHeaders);
+  expectHeads("maxHeaders fields", maxFields, {complete(maxFields)});
+  expectHeads("maxHeaders + 1 fields", headWithFields(httpScan::maxHeaders + 1),
+              {malformed});
+
+  // a head of exactly the limit, and one byte more
+  std::string atLimit = "GET / HTTP/1.1\r\nX-Padding: ";
+  atLimit.append(requestParser::defaultMaxHeadSize - atLimit.size() - 4, 'a');
+  atLimit += "\r\n\r\n";
+  expectHeads("head at the size limit", atLimit, {complete(atLimit)});
+
+  std::string overLimit = atLimit;
+  overLimit.insert(overLimit.size() - 4, "a");
+  expectHeads("head over the size limit", overLimit, {malformed});
+}
+
+// the line ends of a value at every offset of a SIMD block
+void lineEnds() {
+  for (std::size_t length = 0; length < 70; length++) {
+    std::string value(length, 'v');
+    auto head = std::format("GET / HTTP/1.1\r\nX-Value: {}\r\nHost: a\r\n\r\n",
+                            value);
+    httpRequest request;
+    auto parsed = request.parseResquest(std::make_shared<std::string>(head));
+    check(parsed && request.headers.get("x-value") == value &&
+              request.headers.get("host") == "a",
+          std::format("value of {} bytes", length));
+  }
+}
+
+// the block paths of findFirst against the byte by byte matcher, at every
+// offset of the blocks
+template <typename M> void compareMatcher(std::string_view name, M match) {
+  std::mt19937 rng(42);
+  std::string s(160, 'a');
+
+  for (int round = 0; round < 1000; round++) {
+    for (auto &c : s) {
+      c = 'a';
+    }
+    // a few bytes of any value
+    for (int i = rng() % 4; i > 0; i--) {
+      s[rng() % s.size()] = static_cast<char>(rng());
+    }
+
+    for (std::size_t pos = 0; pos < 64; pos++) {
+      auto expected = httpScan::npos;
+      for (auto i = pos; i < s.size(); i++) {
+        if (match(s[i])) {
+          expected = i;
+          break;
+        }
+      }
+      check(httpScan::findFirst(s, pos, match) == expected,
+            std::format("{} from {}", name, pos));
+    }
+  }
+}
+
+int main() {
+#if defined(__AVX2__)
+  std::println("scanner: AVX2");
+#elif defined(__SSSE3__)
+  std::println("scanner: SSSE3");
+#elif defined(__SSE2__)
+  std::println("scanner: SSE2, header names byte by byte");
+#else
+  std::println("scanner: scalar");
+#endif
+
+  framing();
+  lineEnds();
+  compareMatcher("notTargetChar", httpScan::notTargetChar{});
+  compareMatcher("notFieldChar", httpScan::notFieldChar{});
+  compareMatcher("notTokenChar", httpScan::notTokenChar{});
+
+  std::println("{} failed checks", failures);
+  return failures;
+}
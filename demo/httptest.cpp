@@ -7,6 +7,9 @@
 
 #include <async/Epoll.hpp>
 #include <async/Loop.hpp>
+#include <async/Runtime.hpp>
+#include <async/Scope.hpp>
+#include <async/Sync.hpp>
 #include <async/Tasks.hpp>
 #include <cstddef>
 #include <cstdio>
@@ -21,12 +24,13 @@
 #include <system_error>
 #include <thread>
 #include <unistd.h>
+#include <utility>
 #include <vector>
 
 using namespace ACPAcoro;
 
 auto &threadPoolInst = threadPool::getInstance();
-auto epollInst = epollInstance(threadPoolInst);
+shardedEpoll epollShards(threadPoolInst);
 
 std::filesystem::path webroot{"/var/www/"};
 
@@ -41,8 +45,10 @@ Task<> responseHandler(std::shared_ptr<reactorSocket> socket,
 
   setsockopt(socket->fd, SOL_TCP, TCP_CORK, &on, sizeof(on));
 
+  // the send timer is armed until every response being sent is done
+  auto sending = socket->timeouts.sendStart();
+  std::string_view sendData = *responseStr;
   while (true) {
-    std::string_view sendData = *responseStr;
     auto sendResult = socket->send(sendData.data(), sendData.size());
 
     if (!sendResult) {
@@ -50,7 +56,10 @@ Task<> responseHandler(std::shared_ptr<reactorSocket> socket,
               std::make_error_code(std::errc::resource_unavailable_try_again) ||
           sendResult.error() ==
               make_error_code(std::errc::no_message_available)) {
-        co_await threadPoolInst.scheduler;
+        // cancelled with the scope of the connection
+        if (!co_await socket->writable()) {
+          co_return;
+        }
         continue;
       } else {
         debug("Error: {}", sendResult.error().message());
@@ -59,6 +68,7 @@ Task<> responseHandler(std::shared_ptr<reactorSocket> socket,
 
     } // error handle
     else {
+      socket->timeouts.sendProgress();
       sendData.remove_prefix(sendResult.value());
       if (sendData.empty()) {
         break;
@@ -91,16 +101,12 @@ Task<> responseHandler(std::shared_ptr<reactorSocket> socket,
     }
   }
 
-  // TODO: fix bug
-  // few seconds after launch,
-  // the sendfile will block
+  // a partial send goes on from where it stopped
+  size_t sendBytes = 0;
+  size_t restSize = file.size;
+  auto fileMem =
+      ::mmap(nullptr, file.size, PROT_READ, MAP_PRIVATE, file.fd, 0);
   while (true) {
-    size_t sendBytes = 0;
-    // off_t offset = 0;
-    size_t restSize = file.size;
-    auto fileMem =
-        ::mmap(nullptr, file.size, PROT_READ, MAP_PRIVATE, file.fd, 0);
-
     auto sendResult = socket->send(((char *)fileMem) + sendBytes, restSize);
 
     if (!sendResult) {
@@ -108,7 +114,10 @@ Task<> responseHandler(std::shared_ptr<reactorSocket> socket,
               std::make_error_code(std::errc::resource_unavailable_try_again) ||
           sendResult.error() ==
               make_error_code(std::errc::no_message_available)) {
-        co_await threadPoolInst.scheduler;
+        if (!co_await socket->writable()) {
+          munmap(fileMem, file.size);
+          co_return;
+        }
         continue;
       } else {
         debug("Error: {}", sendResult.error().message());
@@ -118,6 +127,7 @@ Task<> responseHandler(std::shared_ptr<reactorSocket> socket,
 
     } // error handle
     else {
+      socket->timeouts.sendProgress();
       sendBytes += sendResult.value();
       restSize -= sendResult.value();
       if (sendBytes >= file.size) {
@@ -132,13 +142,35 @@ Task<> responseHandler(std::shared_ptr<reactorSocket> socket,
   co_return;
 }
 
-Task<> httpHandle(std::shared_ptr<reactorSocket> socket) {
+// the responses of a connection go out in the order of its requests and
+// never interleave their bytes: each one starts once the previous one has
+// ended, while the next head is already being read.
+// the wait is cancelled with the scope of the connection
+Task<> inTurn(std::shared_ptr<asyncEvent> previous,
+              std::shared_ptr<asyncEvent> done, Task<> response) {
+  // the next response starts however this one ends
+  struct turnEnd {
+    asyncEvent &done;
+    ~turnEnd() { done.set(); }
+  } end{*done};
+
+  if (previous == nullptr || co_await previous->wait()) {
+    co_await response;
+  }
+}
+
+Task<> serveRequests(std::shared_ptr<reactorSocket> socket,
+                     taskScope &scope) {
   // std::println("Handling socket {}", socket->fd);
+  // set when the last response spawned has ended
+  std::shared_ptr<asyncEvent> previous;
   while (true) {
     httpRequest request;
     request.status = ACPAcoro::httpErrc::OK;
-    std::shared_ptr<std::string> requestStr;
 
+    // an idle or slow connection is shut down by its timeouts,
+    // the read then fails with EOF
+    socket->timeouts.waitRequest();
     while (true) {
       auto readResult = request.readRequest(*socket);
 
@@ -149,52 +181,62 @@ Task<> httpHandle(std::shared_ptr<reactorSocket> socket) {
           co_return;
         } else if (readResult.error() ==
                    make_error_code(httpErrc::UNCOMPLETED_REQUEST)) {
-          co_await threadPoolInst.scheduler;
+          if (!co_await socket->readable()) {
+            co_return;
+          }
           continue;
 
+        } else if (readResult.error().category() == httpErrorCode()) {
+          request.status = (httpErrc)readResult.error().value();
+          break;
+
         } else {
           request.status = ACPAcoro::httpErrc::INTERNAL_SERVER_ERROR;
           break;
         }
       } else {
-        request.status = ACPAcoro::httpErrc::OK;
-        requestStr = readResult.value();
+        // the head is split already, status tells if it's a bad one
         break;
       }
     } // read loop
+    socket->timeouts.requestRead();
 
-    if (request.status == ACPAcoro::httpErrc::OK) {
-      request.parseResquest(requestStr);
-    }
-
+    // the end of a malformed head is unknown, the following bytes can't
+    // be parsed
+    auto connection = request.headers.get("Connection");
     bool closeSession =
-        request.status == ACPAcoro::httpErrc::OK &&
-        request.headers.data.contains("Connection") &&
-        request.headers.data.at("Connection") == std::string_view("Close");
+        request.status == ACPAcoro::httpErrc::BAD_REQUEST ||
+        (request.status == ACPAcoro::httpErrc::OK && connection &&
+         httpHeaders::equalsIgnoreCase(*connection, "close"));
 
-    threadPoolInst.addTask(
-        responseHandler(socket, std::move(request)).detach());
+    auto done = std::make_shared<asyncEvent>(false, threadPoolInst);
+    scope.spawn(inTurn(std::exchange(previous, done), done,
+                       responseHandler(socket, std::move(request))));
 
-    if (closeSession)
+    if (closeSession) {
+      // drop the bytes pipelined after it, the fd is reused
+      httpRequest::erasePending(socket->fd);
       co_return;
+    }
 
   } // socket loop
 }
 
+// the responses of a connection are children of its scope,
+// they end before the connection is closed
+Task<> httpHandle(std::shared_ptr<reactorSocket> socket) {
+  co_await withScope(
+      [&](taskScope &scope) { return serveRequests(socket, scope); });
+}
+
 Task<> co_main(std::string const &port) {
   auto server = std::make_unique<serverSocket>(port);
 
   server->listen();
-  auto fd = server->fd;
 
-  epoll_event event;
-  event.events = EPOLLIN;
-  event.data.ptr =
-      acceptAll(std::move(server), httpHandle, epollInst).detach().address();
-  epollInst.addEvent(fd, &event);
+  acceptAll(std::move(server), httpHandle, epollShards);
 
-  threadPoolInst.addTask(epollInst.epollWaitEvent(100).detach());
-  threadPoolInst.enter();
+  epollShards.run();
 
   co_return;
 }
@@ -212,10 +254,9 @@ int main(int argc, char *argv[]) {
     webroot = argv[2];
   }
 
-  auto mainTask = co_main(port);
-  while (!mainTask.selfCoro.done()) {
-    mainTask.resume();
-  }
+  runtime rt(threadPoolInst);
+  rt.blockOn(co_main(port));
+  rt.wait();
 
   return 0;
 }
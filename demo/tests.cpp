@@ -1,4 +1,6 @@
+#include "async/Generator.hpp"
 #include "async/Loop.hpp"
+#include "async/Runtime.hpp"
 #include "async/Tasks.hpp"
 #include "async/Timer.hpp"
 #include "async/WhenAll.hpp"
@@ -6,6 +8,7 @@
 
 #include <chrono>
 #include <filesystem>
+#include <format>
 #include <print>
 #include <system_error>
 using namespace ACPAcoro;
@@ -30,6 +33,14 @@ Task<int, yieldPromiseType<int>> run3times() {
   co_return 3;
 }
 
+// each line is produced when the consumer asks for it
+asyncGenerator<std::string> lines() {
+  for (int i = 0; i < 3; i++) {
+    co_await sleepFor(100ms);
+    co_yield std::format("line {}", i);
+  }
+}
+
 ACPAcoro::Task<int> get_value() { co_return 42; }
 
 Task<int> get_42() { co_return 42; }
@@ -45,14 +56,10 @@ ACPAcoro::Task<> co_main() {
   auto value = co_await get_value();
   std::println("get_value() returned: {}", value);
 
-  auto sleeptask1 = sleepFor(1s, hello().detach());
-  auto sleeptask2 = sleepFor(2s, hello().detach());
-  loopInstance::getInstance().addTask(sleeptask1);
-  loopInstance::getInstance().addTask(sleeptask2);
-
-  loopInstance::getInstance().addTask(sleepFor(5s, hello().detach()).detach());
-
-  loopInstance::getInstance().runAll();
+  auto &pool = threadPool::current();
+  pool.spawn(sleepFor(1s, hello().detach()).detach());
+  pool.spawn(sleepFor(2s, hello().detach()).detach());
+  pool.spawn(sleepFor(5s, hello().detach()).detach());
 
   auto [a, b, voidret] = co_await whenAll(get_3_14(), get_42(), sleepFor(1s));
 
@@ -74,8 +81,12 @@ ACPAcoro::Task<> co_main() {
 
   auto gen2 = run3times();
   while (!gen2.selfCoro.done()) {
-    loopInstance::getInstance().addTask(gen2);
-    loopInstance::getInstance().runAll();
+    co_await gen2;
+  }
+
+  auto stream = lines();
+  while (auto line = co_await stream.next()) {
+    std::println("lines() yielded: {}", *line);
   }
 
   co_return;
@@ -91,15 +102,10 @@ void fstest() {
 }
 
 int main() {
-  // auto task = co_main();
-  // std::println("co_main() started");
-  // loopInstance::getInstance().addTask(task);
-  // while (!task.selfCoro.done()) {
-  //   loopInstance::getInstance().runAll();
-  // }
-  //
-  // std::println("co_main() ended");
-  //
+  std::println("co_main() started");
+  syncWait(co_main());
+  std::println("co_main() ended");
+
   fstest();
 
   return 0;
@@ -1,5 +1,7 @@
 #include "async/Loop.hpp"
+#include "async/Runtime.hpp"
 #include "async/Tasks.hpp"
+#include "async/WhenAll.hpp"
 #include "utils/DEBUG.hpp"
 #include <print>
 
@@ -23,8 +25,7 @@ int main() {
   threadPool &pool = threadPool::getInstance();
   debug("main get pool");
 
-  for (int i = 0; i < 2; i++) {
-    pool.addTask(co_main(pool).detach());
-  }
-  pool.enter();
+  runtime rt(pool);
+  rt.blockOn(whenAll(co_main(pool), co_main(pool)));
+  debug("main end");
 }
@@ -0,0 +1,108 @@
+#include "async/Runtime.hpp"
+#include "async/Tasks.hpp"
+#include "async/Timer.hpp"
+#include "async/Uring.hpp"
+#include "uring/Message.hpp"
+#include "uring/Socket.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <print>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+
+using namespace ACPAcoro;
+using namespace std::chrono_literals;
+
+// checks of IORING_OP_MSG_RING between two rings
+//
+// one end of a socketpair is handed over by the source ring to the mailbox
+// of the target ring, which echoes on it through the target ring while the
+// source ring talks to the other end. a plain token is posted as well, it
+// must reach the handler with its value untouched.
+// exit with the number of failed checks
+
+auto &threadPoolInst = threadPool::getInstance();
+uringInstance sourceRing{threadPoolInst};
+uringInstance targetRing{threadPoolInst};
+constexpr int wakeToken = 1 << 20;
+std::atomic<int> handedOver = 0;
+std::atomic<int> tokens = 0;
+int failures = 0;
+
+void check(bool ok, std::string const &what) {
+  if (!ok) {
+    failures++;
+    std::println("FAILED: {}", what);
+  }
+}
+
+// echo once on the handed over fd through the ring it was handed to
+Task<> echoOnce(int fd) {
+  handedOver++;
+  asyncSocket conn(fd);
+  char buf[64];
+  auto recvRes = co_await conn.recv(buf, sizeof(buf), 0, targetRing);
+  if (recvRes && recvRes.value() > 0) {
+    co_await conn.send(buf, recvRes.value(), 0, targetRing);
+  }
+}
+
+Task<> onMessage(int value) {
+  if (value == wakeToken) {
+    tokens++;
+    co_return;
+  }
+  co_await echoOnce(value);
+}
+
+auto onPost = [](int value) { return onMessage(value); };
+using mailboxType = ringMailbox<decltype(onPost)>;
+
+// wait until the counter reaches the value or give up after a while
+Task<bool> reaches(std::atomic<int> &counter, int value) {
+  for (int i = 0; i < 100 && counter < value; i++) {
+    co_await sleepFor(10ms);
+  }
+  co_return counter == value;
+}
+
+Task<> checks(mailboxType &mailbox) {
+  auto tokenRes = co_await mailbox.post(wakeToken, sourceRing);
+  check(tokenRes.has_value(), "post a token to the target ring");
+  check(co_await reaches(tokens, 1), "token delivered to the mailbox");
+
+  int fds[2];
+  if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+    check(false, "socketpair");
+    co_return;
+  }
+  asyncSocket local(fds[0]);
+  auto handoffRes = co_await handoffConnection(fds[1], mailbox, sourceRing);
+  check(handoffRes.has_value(), "hand over a connection");
+  check(co_await reaches(handedOver, 1), "connection reached the handler");
+
+  std::string_view message = "ping";
+  co_await local.send(message.data(), message.size(), 0, sourceRing);
+  char buf[64];
+  auto recvRes = co_await local.recv(buf, sizeof(buf), 0, sourceRing);
+  check(recvRes && std::string_view(buf, recvRes.value()) == message,
+        "echo through the target ring");
+  check(tokens == 1, "a connection is not taken for a token");
+}
+
+int main() {
+  runtime rt(threadPoolInst);
+
+  // both rings reap, the target dispatches the messages of its mailbox
+  mailboxType mailbox(targetRing, onPost);
+  threadPoolInst.spawn(sourceRing.reapIOs<>().detach());
+  threadPoolInst.spawn(targetRing.reapIOs<mailboxType>().detach());
+
+  rt.blockOn(checks(mailbox));
+  rt.stop();
+
+  std::println("{} failed checks", failures);
+  return failures;
+}
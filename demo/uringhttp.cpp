@@ -1,19 +1,27 @@
 
+#include "async/Context.hpp"
 #include "async/Loop.hpp"
+#include "async/Runtime.hpp"
+#include "async/Scope.hpp"
+#include "async/Sync.hpp"
 #include "async/Tasks.hpp"
 #include "async/Uring.hpp"
 #include "file/File.hpp"
 #include "file/FileCache.hpp"
 #include "http/Http.hpp"
+#include "http/HttpParser.hpp"
 #include "http/Socket.hpp"
 #include "tl/expected.hpp"
 #include "uring/Socket.hpp"
+#include <atomic>
+#include <cstdint>
 #include <filesystem>
 #include <memory>
 #include <print>
 #include <string>
 #include <sys/mman.h>
 #include <system_error>
+#include <utility>
 
 using namespace ACPAcoro;
 
@@ -24,9 +32,17 @@ uringInstance uringInst{threadPoolInst};
 auto fileCacheLruInst =
     fileCacheFactory::create(1024, fileCacheFactory::policy::LRU);
 std::filesystem::path webRoot;
+// responses being sent at once, a connection waits for a slot
+// before reading its next request
+asyncSemaphore inFlight{4096, threadPoolInst};
+std::atomic<std::uint64_t> connectionCount = 0;
 
+// the permit is moved into the body, so it's released as the handler ends,
+// not when its frame is destroyed by the clean thread later on
 Task<> responseHandler(std::shared_ptr<asyncSocket> client,
-                       httpRequest request) {
+                       httpRequest request, asyncSemaphore::permit permit) {
+  [[maybe_unused]] auto slot = std::move(permit);
+  [[maybe_unused]] auto context = co_await currentContext{};
 
   httpResponse response(request, webRoot);
 
@@ -37,19 +53,22 @@ Task<> responseHandler(std::shared_ptr<asyncSocket> client,
 
   fileCacheBuilder::wrappedType file;
   if (response.status == httpResponse::statusCode::OK) {
-    file = fileCacheLruInst->get(response.uri);
+    file = co_await fileCacheLruInst->fetch(response.uri);
 
     if (file == nullptr) {
       response.status = httpResponse::statusCode::NOT_FOUND;
     } else {
-      response.headers.data["Content-Length"] = std::to_string(file->size());
+      response.headers.addOwned("Content-Length",
+                                std::to_string(file->size()));
     }
   }
 
   auto responseStr = response.serialize();
 
+  // the send timer is armed until every response being sent is done
+  auto sending = client->timeouts.sendStart();
+  std::string_view sendData = *responseStr;
   while (true) {
-    std::string_view sendData = *responseStr;
     auto sendResult =
         co_await client->send(sendData.data(), sendData.size(), 0, uringInst);
 
@@ -64,12 +83,14 @@ Task<> responseHandler(std::shared_ptr<asyncSocket> client,
         continue;
 
       } else {
-        debug("Error: {}", sendResult.error().message());
+        debug("Connection {}: {}", context->requestId,
+              sendResult.error().message());
         co_return;
       }
 
     } // error handle
     else {
+      client->timeouts.sendProgress();
       sendData.remove_prefix(sendResult.value());
       if (sendData.empty()) {
         break;
@@ -82,14 +103,10 @@ Task<> responseHandler(std::shared_ptr<asyncSocket> client,
     co_return;
   }
 
-  // TODO: fix bug
-  // few seconds after launch,
-  // the sendfile will block
+  // a partial send goes on from where it stopped
+  size_t sendBytes = 0;
+  size_t restSize = file->size();
   while (true) {
-    size_t sendBytes = 0;
-    // off_t offset = 0;
-    size_t restSize = file->size();
-
     auto sendResult =
         co_await client->send(file->data() + sendBytes, restSize, 0, uringInst);
 
@@ -102,12 +119,14 @@ Task<> responseHandler(std::shared_ptr<asyncSocket> client,
         co_await threadPoolInst.scheduler;
         continue;
       } else {
-        debug("Error: {}", sendResult.error().message());
+        debug("Connection {}: {}", context->requestId,
+              sendResult.error().message());
         co_return;
       }
 
     } // error handle
     else {
+      client->timeouts.sendProgress();
       sendBytes += sendResult.value();
       restSize -= sendResult.value();
       if (sendBytes >= file->size()) {
@@ -121,13 +140,22 @@ Task<> responseHandler(std::shared_ptr<asyncSocket> client,
   co_return;
 }
 
-Task<expectedRet<std::unique_ptr<std::string>>>
-readRequest(asyncSocket &client) {
-
-  auto request = std::make_unique<std::string>();
+// shared, the parsed request keeps it for the views of its headers.
+// each recv is fed to the parser as it arrives, the bytes past the head
+// are left in leftover for the next request of the connection.
+// the parser keeps the bounds of the head to split it with
+Task<expectedRet<std::shared_ptr<std::string>>>
+readRequest(asyncSocket &client, std::string &leftover,
+            requestParser &parser) {
+
+  auto request = std::make_shared<std::string>(std::move(leftover));
+  leftover.clear();
+  parser.reset();
+  // a pipelined request may be complete already
+  parser.feed(*request);
   char buf[1024];
 
-  while (true) {
+  while (parser.status() == httpScan::headStatus::incomplete) {
 
     auto readRes = co_await client.recv(buf, sizeof(buf), 0, uringInst);
 
@@ -138,9 +166,6 @@ readRequest(asyncSocket &client) {
       }
       if (readRes.error() == make_error_code(std::errc::connection_reset)) {
         client.closed = true;
-        if (request->ends_with("\r\n\r\n")) {
-          co_return std::move(request);
-        }
         co_return tl::unexpected(make_error_code(httpErrc::BAD_REQUEST));
       }
       co_return tl::unexpected(readRes.error());
@@ -148,61 +173,106 @@ readRequest(asyncSocket &client) {
 
     if (readRes.value() == 0) {
       client.closed = true;
-      if (request->ends_with("\r\n\r\n")) {
-        co_return std::move(request);
-      }
-      co_return tl::unexpected(make_error_code(httpErrc::BAD_REQUEST));
-    }
-
-    if ((readRes.value() + request->size()) > 4096) {
       co_return tl::unexpected(make_error_code(httpErrc::BAD_REQUEST));
     }
 
     request->append(buf, readRes.value());
+    parser.feed({buf, static_cast<std::size_t>(readRes.value())});
+    client.timeouts.readProgress();
+  }
 
-    if (request->ends_with("\r\n\r\n")) {
-      break;
-    }
+  // malformed or too long
+  if (parser.status() == httpScan::headStatus::malformed) {
+    co_return tl::unexpected(make_error_code(httpErrc::BAD_REQUEST));
   }
 
+  leftover.assign(*request, parser.headSize());
+  request->resize(parser.headSize());
   co_return std::move(request);
 }
 
-Task<> clientHandle(int fd) {
-  auto client = std::make_shared<asyncSocket>(fd);
+// the responses of a connection go out in the order of its requests and
+// never interleave their bytes: each one starts once the previous one has
+// ended, while the next head is already being read.
+// the wait is cancelled with the scope of the connection
+Task<> inTurn(std::shared_ptr<asyncEvent> previous,
+              std::shared_ptr<asyncEvent> done, Task<> response) {
+  // the next response starts however this one ends
+  struct turnEnd {
+    asyncEvent &done;
+    ~turnEnd() { done.set(); }
+  } end{*done};
+
+  if (previous == nullptr || co_await previous->wait()) {
+    co_await response;
+  }
+}
 
+Task<> serveRequests(std::shared_ptr<asyncSocket> client, taskScope &scope) {
+  auto context = co_await currentContext{};
+  // the start of the next request, read with the previous one
+  std::string leftover;
+  requestParser parser;
+  // set when the last response spawned has ended
+  std::shared_ptr<asyncEvent> previous;
   while (true) {
     httpRequest request;
     request.status = ACPAcoro::httpErrc::OK;
 
-    auto requestMsg = co_await readRequest(*client);
+    // an idle or slow connection is shut down by its timeouts,
+    // the recv then returns EOF
+    client->timeouts.waitRequest();
+    auto requestMsg = co_await readRequest(*client, leftover, parser);
+    client->timeouts.requestRead();
 
     if (!requestMsg) {
       if (requestMsg.error().category() == httpErrorCode()) {
         request.status = (httpErrc)requestMsg.error().value();
       } else {
-        errorlog("Error: {}", requestMsg.error().message());
+        errorlog("Connection {}: {}", context->requestId,
+                 requestMsg.error().message());
         co_return;
       }
     }
 
     if (request.status == ACPAcoro::httpErrc::OK) {
-      request.parseResquest(std::move(requestMsg.value()));
+      request.parseResquest(std::move(requestMsg.value()), parser);
     }
 
+    // the end of a malformed head is unknown, the following bytes can't
+    // be parsed
+    auto connection = request.headers.get("Connection");
     bool closeSession =
-        request.status == ACPAcoro::httpErrc::OK &&
-        request.headers.data.contains("Connection") &&
-        request.headers.data.at("Connection") == std::string_view("Close");
+        request.status == ACPAcoro::httpErrc::BAD_REQUEST ||
+        (request.status == ACPAcoro::httpErrc::OK && connection &&
+         httpHeaders::equalsIgnoreCase(*connection, "close"));
 
-    threadPoolInst.addTask(
-        responseHandler(client, std::move(request)).detach());
+    auto permit = co_await inFlight.scoped();
+    if (!permit) {
+      co_return;
+    }
+    auto done = std::make_shared<asyncEvent>(false, threadPoolInst);
+    scope.spawn(inTurn(
+        std::exchange(previous, done), done,
+        responseHandler(client, std::move(request), std::move(*permit))));
 
     if (closeSession || client->closed)
       co_return;
   }
 }
 
+// the responses of a connection are children of its scope,
+// they end before the connection is closed.
+// the coroutines of the connection log its id from their context
+Task<> clientHandle(int fd) {
+  auto client = std::make_shared<asyncSocket>(fd);
+  taskContext context{
+      .requestId = connectionCount.fetch_add(1, std::memory_order::relaxed)};
+  co_await setContext{&context};
+  co_await withScope(
+      [&](taskScope &scope) { return serveRequests(client, scope); });
+}
+
 int main(int argc, char **argv) {
   if (argc < 3) {
     std::println("Usage: {} [port] [webRoot directory]", argv[0]);
@@ -212,11 +282,17 @@ int main(int argc, char **argv) {
   std::string port = argv[1];
   webRoot = argv[2];
 
+  runtime rt(threadPoolInst);
+
   auto server = std::make_unique<serverSocket>(port);
   server->listen();
   debug("Server launch");
-  threadPoolInst.addTask(uringInst.reapIOs().detach());
-  threadPoolInst.addTask(
-      asyncAccept(std::move(server), clientHandle, uringInst).detach());
-  threadPoolInst.enter();
+  auto onAccept = [](int fd) { return clientHandle(fd); };
+  // the reaper knows the accept awaiter, connections start with a direct call
+  threadPoolInst.spawn(
+      uringInst.reapIOs<multishotAcceptAwaiter<decltype(onAccept)>>()
+          .detach());
+  threadPoolInst.spawn(
+      asyncAccept(std::move(server), onAccept, uringInst).detach());
+  rt.wait();
 }
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <atomic>
+#include <concepts>
+#include <coroutine>
+#include <mutex>
+#include <type_traits>
+
+namespace ACPAcoro {
+
+// intrusive entry of a cancelSource, lives in the awaiter of the
+// cancellable operation
+struct cancelCallback {
+  bool linked() const noexcept { return pprev != nullptr; }
+
+  void (*invoke)(cancelCallback &) = nullptr;
+
+private:
+  friend struct cancelSource;
+
+  cancelCallback **pprev = nullptr;
+  cancelCallback *next = nullptr;
+};
+
+// cancellation shared by a tree of coroutines
+//
+// a coroutine awaiting a Task passes its source to the task, and the
+// cancellable awaiters register a callback on it while suspended.
+// requestCancel() calls every registered callback once, they must be short
+// as they run with the lock held, e.g. submitting an io_uring cancel or
+// pulling a timer from the wheel and queuing its coroutine.
+struct cancelSource {
+  cancelSource() = default;
+  cancelSource(cancelSource const &) = delete;
+  cancelSource &operator=(cancelSource const &) = delete;
+
+  bool cancelled() const noexcept {
+    return requested.load(std::memory_order::acquire);
+  }
+
+  // return false if it's already cancelled
+  bool requestCancel() {
+    std::scoped_lock<decltype(mutex)> lock(mutex);
+    if (requested.exchange(true, std::memory_order::acq_rel)) {
+      return false;
+    }
+    while (head != nullptr) {
+      auto callback = head;
+      unlink(*callback);
+      callback->invoke(*callback);
+    }
+    return true;
+  }
+
+  // register the callback and start the operation under the lock,
+  // so a cancel either comes first and the operation isn't started,
+  // or sees the started operation.
+  // start returns whether the operation is pending and the callback is kept.
+  // return false if it's already cancelled
+  template <typename F>
+    requires std::invocable<F> &&
+             std::convertible_to<std::invoke_result_t<F>, bool>
+  bool attach(cancelCallback &callback, F &&start) {
+    std::scoped_lock<decltype(mutex)> lock(mutex);
+    if (requested.load(std::memory_order::relaxed)) {
+      return false;
+    }
+    if (start()) {
+      link(callback);
+    }
+    return true;
+  }
+
+  // the callback won't be called once detached
+  void detach(cancelCallback &callback) {
+    std::scoped_lock<decltype(mutex)> lock(mutex);
+    if (callback.linked()) {
+      unlink(callback);
+    }
+  }
+
+private:
+  void link(cancelCallback &callback) {
+    callback.next = head;
+    if (head != nullptr) {
+      head->pprev = &callback.next;
+    }
+    callback.pprev = &head;
+    head = &callback;
+  }
+
+  void unlink(cancelCallback &callback) {
+    *callback.pprev = callback.next;
+    if (callback.next != nullptr) {
+      callback.next->pprev = callback.pprev;
+    }
+    callback.pprev = nullptr;
+    callback.next = nullptr;
+  }
+
+  std::atomic<bool> requested = false;
+  std::mutex mutex;
+  cancelCallback *head = nullptr;
+};
+
+// forward the cancel of a source to another, e.g. from the caller to the
+// children of a whenAny or a taskScope. a null source forwards nothing
+struct forwardCancel : cancelCallback {
+  static void forward(cancelCallback &callback) {
+    static_cast<forwardCancel &>(callback).target->requestCancel();
+  }
+
+  forwardCancel(cancelSource *from, cancelSource &to)
+      : source(from), target(&to) {
+    invoke = &forward;
+    if (source != nullptr && !source->attach(*this, [] { return true; })) {
+      target->requestCancel();
+    }
+  }
+
+  ~forwardCancel() {
+    if (source != nullptr) {
+      source->detach(*this);
+    }
+  }
+
+  forwardCancel(forwardCancel const &) = delete;
+  forwardCancel &operator=(forwardCancel const &) = delete;
+
+  cancelSource *source;
+  cancelSource *target;
+};
+
+// promises carrying the cancel source of their coroutine
+struct cancellablePromise {
+  cancelSource *cancel = nullptr;
+};
+
+// the cancel source of a suspended coroutine, if it has one
+template <typename P>
+cancelSource *cancelSourceOf(std::coroutine_handle<P> coro) noexcept {
+  if constexpr (std::derived_from<P, cancellablePromise>) {
+    return coro.promise().cancel;
+  } else {
+    return nullptr;
+  }
+}
+
+// co_await currentCancel{} returns the cancel source of this coroutine,
+// nullptr if it's not cancellable
+struct currentCancel {
+  bool await_ready() const noexcept { return false; }
+
+  template <typename P>
+  bool await_suspend(std::coroutine_handle<P> coro) noexcept {
+    source = cancelSourceOf(coro);
+    return false;
+  }
+
+  cancelSource *await_resume() const noexcept { return source; }
+
+  cancelSource *source = nullptr;
+};
+
+} // namespace ACPAcoro
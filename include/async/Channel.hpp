@@ -0,0 +1,351 @@
+#pragma once
+
+#include "async/Loop.hpp"
+#include "async/WaitList.hpp"
+#include "tl/expected.hpp"
+
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+namespace ACPAcoro {
+
+enum class channelErr {
+  success = 0,
+  closed,
+};
+
+inline auto const &channelErrorCode() {
+  static struct channelErrorCategory : public std::error_category {
+    char const *name() const noexcept override { return "channelError"; }
+
+    std::string message(int c) const override {
+      switch (static_cast<channelErr>(c)) {
+      case channelErr::success:
+        return "Success";
+      case channelErr::closed:
+        return "Channel closed";
+      default:
+        return "Unknown error";
+      }
+    }
+  } instance;
+  return instance;
+}
+
+inline std::error_code make_error_code(channelErr e) {
+  return {static_cast<int>(e), channelErrorCode()};
+}
+
+// bounded multi producer multi consumer channel between coroutines
+//
+// send() parks the sender while the channel is full and recv() parks the
+// receiver while it's empty, a capacity of 0 makes every send wait for a
+// receiver.
+// the buffer is a lock-free ring of cells stamped with sequence numbers:
+// while nobody is parked, a send or a recv claims a cell with one CAS on
+// its position and never takes the mutex. the mutex guards the parked
+// senders and receivers. a coroutine parks under it, then tries the ring
+// again, and a send or recv seeing parked coroutines on the other side
+// takes it to hand them values. the flag is checked after a fence on one
+// side and set before a fence on the other, so one of the two always sees
+// the other. the fast path may overtake parked coroutines, values are FIFO
+// but the waiters aren't strictly.
+//
+// parked senders and receivers are woken with ECANCELED if their
+// coroutine is cancelled, and with channelErr::closed by close()
+template <typename T> class channel {
+  template <typename, typename> friend struct parkingAwaiter;
+
+public:
+  struct sendAwaiter : parkingAwaiter<sendAwaiter, channel> {
+    tl::expected<void, std::error_code> await_resume() {
+      this->detachCancel();
+      if (this->error) {
+        return tl::unexpected(this->error);
+      }
+      return {};
+    }
+
+    // return true if parked
+    bool tryOrPark() {
+      auto &chan = this->owner;
+      if (chan.closed.load(std::memory_order::acquire)) {
+        this->error = make_error_code(channelErr::closed);
+        return false;
+      }
+      if (chan.tryPush(value)) {
+        chan.wakeParked(chan.receiversParked);
+        return false;
+      }
+
+      std::vector<std::coroutine_handle<>> woken;
+      bool parked;
+      {
+        std::unique_lock<decltype(chan.mutex)> lock(chan.mutex);
+        if (chan.closed.load(std::memory_order::relaxed)) {
+          this->error = make_error_code(channelErr::closed);
+          return false;
+        }
+        chan.senders.push(*this);
+        chan.sendersParked.store(true, std::memory_order::relaxed);
+        std::atomic_thread_fence(std::memory_order::seq_cst);
+        // a slot freed since the try above, or a parked receiver
+        chan.balance(woken);
+        parked = this->queued;
+      }
+      // served by balance(), it goes on without suspending
+      if (!parked) {
+        std::erase(woken, this->coro);
+      }
+      chan.resume(woken);
+      return parked;
+    }
+
+    waiterList &list() { return this->owner.senders; }
+
+    sendAwaiter(channel &chan, T &&value)
+        : parkingAwaiter<sendAwaiter, channel>(chan), value(std::move(value)) {}
+
+    T value;
+  };
+
+  struct recvAwaiter : parkingAwaiter<recvAwaiter, channel> {
+    tl::expected<T, std::error_code> await_resume() {
+      this->detachCancel();
+      if (this->error) {
+        return tl::unexpected(this->error);
+      }
+      return std::move(*value);
+    }
+
+    // return true if parked
+    bool tryOrPark() {
+      auto &chan = this->owner;
+      if (chan.tryPop(value)) {
+        chan.wakeParked(chan.sendersParked);
+        return false;
+      }
+
+      std::vector<std::coroutine_handle<>> woken;
+      bool parked;
+      {
+        std::unique_lock<decltype(chan.mutex)> lock(chan.mutex);
+        chan.receivers.push(*this);
+        chan.receiversParked.store(true, std::memory_order::relaxed);
+        std::atomic_thread_fence(std::memory_order::seq_cst);
+        // a value sent since the try above, or a parked sender
+        chan.balance(woken);
+        parked = this->queued;
+
+        // closed and drained
+        if (parked && chan.closed.load(std::memory_order::relaxed)) {
+          chan.receivers.erase(*this);
+          chan.updateParked();
+          this->error = make_error_code(channelErr::closed);
+          parked = false;
+        }
+      }
+      // served by balance(), it goes on without suspending
+      if (!parked) {
+        std::erase(woken, this->coro);
+      }
+      chan.resume(woken);
+      return parked;
+    }
+
+    waiterList &list() { return this->owner.receivers; }
+
+    explicit recvAwaiter(channel &chan)
+        : parkingAwaiter<recvAwaiter, channel>(chan) {}
+
+    std::optional<T> value;
+  };
+
+  explicit channel(std::size_t capacity,
+                   threadPool &pool = threadPool::current())
+      : cells(std::make_unique<cell[]>(capacity)), size(capacity),
+        pool(pool) {
+    for (std::size_t i = 0; i < capacity; i++) {
+      cells[i].sequence.store(2 * i, std::memory_order::relaxed);
+    }
+  }
+
+  channel(channel const &) = delete;
+  channel &operator=(channel const &) = delete;
+
+  // co_await send(v) returns channelErr::closed if the channel is closed
+  sendAwaiter send(T value) { return sendAwaiter(*this, std::move(value)); }
+
+  // co_await recv() returns the next value, or channelErr::closed once the
+  // channel is closed and drained
+  recvAwaiter recv() { return recvAwaiter(*this); }
+
+  // no more values can be sent, the buffered ones can still be received
+  // parked senders and receivers are woken with channelErr::closed.
+  // a send already past its check of closed may still buffer its value
+  void close() {
+    std::vector<std::coroutine_handle<>> woken;
+    {
+      std::scoped_lock<decltype(mutex)> lock(mutex);
+      if (closed.load(std::memory_order::relaxed)) {
+        return;
+      }
+      closed.store(true, std::memory_order::release);
+      for (auto list : {&senders, &receivers}) {
+        while (!list->empty()) {
+          auto &node = list->pop();
+          node.error = make_error_code(channelErr::closed);
+          woken.push_back(node.coro);
+        }
+      }
+      updateParked();
+    }
+    resume(woken);
+  }
+
+  std::size_t capacity() const noexcept { return size; }
+
+private:
+  // stamped 2 * pos when the cell is free for the value of position pos,
+  // 2 * pos + 1 once it holds it. the stamps of a free and a full cell
+  // never meet, even with a single cell
+  struct cell {
+    std::atomic<std::size_t> sequence;
+    std::optional<T> value;
+  };
+
+  // move value into the ring, left untouched if it's full
+  bool tryPush(T &value) {
+    if (size == 0) {
+      return false;
+    }
+    auto pos = pushPos.load(std::memory_order::relaxed);
+    while (true) {
+      auto &slot = cells[pos % size];
+      auto seq = slot.sequence.load(std::memory_order::acquire);
+      auto diff = static_cast<std::ptrdiff_t>(seq - 2 * pos);
+      if (diff == 0) {
+        if (pushPos.compare_exchange_weak(pos, pos + 1,
+                                          std::memory_order::relaxed)) {
+          slot.value.emplace(std::move(value));
+          slot.sequence.store(2 * pos + 1, std::memory_order::release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = pushPos.load(std::memory_order::relaxed);
+      }
+    }
+  }
+
+  bool tryPop(std::optional<T> &value) {
+    if (size == 0) {
+      return false;
+    }
+    auto pos = popPos.load(std::memory_order::relaxed);
+    while (true) {
+      auto &slot = cells[pos % size];
+      auto seq = slot.sequence.load(std::memory_order::acquire);
+      auto diff = static_cast<std::ptrdiff_t>(seq - (2 * pos + 1));
+      if (diff == 0) {
+        if (popPos.compare_exchange_weak(pos, pos + 1,
+                                         std::memory_order::relaxed)) {
+          value.emplace(std::move(*slot.value));
+          slot.value.reset();
+          slot.sequence.store(2 * (pos + size), std::memory_order::release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = popPos.load(std::memory_order::relaxed);
+      }
+    }
+  }
+
+  // after a push or a pop on the fast path, serve the other side if some
+  // coroutine of it parked meanwhile
+  void wakeParked(std::atomic<bool> &parked) {
+    std::atomic_thread_fence(std::memory_order::seq_cst);
+    if (!parked.load(std::memory_order::relaxed)) {
+      return;
+    }
+    std::vector<std::coroutine_handle<>> woken;
+    {
+      std::scoped_lock<decltype(mutex)> lock(mutex);
+      balance(woken);
+    }
+    resume(woken);
+  }
+
+  // the lock must be held
+  // hand the buffered values and the ones of parked senders to parked
+  // receivers, then move the values of parked senders into the free cells
+  void balance(std::vector<std::coroutine_handle<>> &woken) {
+    while (!receivers.empty()) {
+      auto &receiver = static_cast<recvAwaiter &>(*receivers.head);
+      if (!tryPop(receiver.value)) {
+        // a send between its claim and its stamp goes first, it serves
+        // the receiver once it's done
+        if (senders.empty() || pushPos.load(std::memory_order::relaxed) !=
+                                   popPos.load(std::memory_order::relaxed)) {
+          break;
+        }
+        // unbuffered or drained, take from a parked sender directly
+        auto &sender = static_cast<sendAwaiter &>(senders.pop());
+        receiver.value.emplace(std::move(sender.value));
+        woken.push_back(sender.coro);
+      }
+      receivers.pop();
+      woken.push_back(receiver.coro);
+    }
+
+    while (!senders.empty()) {
+      auto &sender = static_cast<sendAwaiter &>(*senders.head);
+      if (!tryPush(sender.value)) {
+        break;
+      }
+      senders.pop();
+      woken.push_back(sender.coro);
+    }
+    updateParked();
+  }
+
+  // the lock must be held
+  // a cancelled waiter leaves its flag set until the next update, which
+  // only costs the fast path a trip through the lock meanwhile
+  void updateParked() {
+    sendersParked.store(!senders.empty(), std::memory_order::relaxed);
+    receiversParked.store(!receivers.empty(), std::memory_order::relaxed);
+  }
+
+  void resume(std::vector<std::coroutine_handle<>> const &woken) {
+    for (auto coro : woken) {
+      pool.addTask(coro);
+    }
+  }
+
+  std::unique_ptr<cell[]> cells;
+  std::size_t size;
+  // the positions are claimed by the senders and the receivers apart
+  alignas(64) std::atomic<std::size_t> pushPos = 0;
+  alignas(64) std::atomic<std::size_t> popPos = 0;
+  alignas(64) std::atomic<bool> sendersParked = false;
+  std::atomic<bool> receiversParked = false;
+  std::atomic<bool> closed = false;
+  waiterList senders;
+  waiterList receivers;
+  std::mutex mutex;
+  threadPool &pool;
+};
+
+} // namespace ACPAcoro
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "utils/Clock.hpp"
+
+#include <chrono>
+#include <concepts>
+#include <coroutine>
+#include <cstdint>
+
+namespace ACPAcoro {
+
+// metadata of the request a tree of coroutines works for
+//
+// a coroutine awaiting a Task passes its context to the task, like its
+// cancel source, so callees see it whatever worker they run on, unlike a
+// thread_local. the children of a taskScope, a whenAll or a whenAny get
+// the context of the coroutine creating them.
+// only the pointer is copied, the context lives in the frame of the
+// coroutine setting it, which outlives the tasks it awaits or joins.
+// the deadline is checked against the coarse clock of the workers, it
+// costs a load rather than a clock read per check
+struct taskContext {
+  using clock = coarseClock;
+
+  // a context for a span of the work, inheriting the rest of this one
+  taskContext child(std::uint64_t span) const noexcept {
+    auto context = *this;
+    context.spanId = span;
+    context.parent = this;
+    return context;
+  }
+
+  bool expired() const noexcept { return clock::now() >= deadline; }
+
+  // time left until the deadline, zero once expired
+  clock::duration remaining() const noexcept {
+    auto now = clock::now();
+    return now >= deadline ? clock::duration::zero() : deadline - now;
+  }
+
+  std::uint64_t requestId = 0;
+  std::uint64_t traceId = 0;
+  std::uint64_t spanId = 0;
+  clock::time_point deadline = clock::time_point::max();
+  taskContext const *parent = nullptr;
+};
+
+// promises carrying the context of their coroutine
+struct contextPromise {
+  taskContext const *context = nullptr;
+};
+
+// the context of a suspended coroutine, if it has one
+template <typename P>
+taskContext const *contextOf(std::coroutine_handle<P> coro) noexcept {
+  if constexpr (std::derived_from<P, contextPromise>) {
+    return coro.promise().context;
+  } else {
+    return nullptr;
+  }
+}
+
+// co_await currentContext{} returns the context of this coroutine,
+// nullptr if it has none
+struct currentContext {
+  bool await_ready() const noexcept { return false; }
+
+  template <typename P>
+  bool await_suspend(std::coroutine_handle<P> coro) noexcept {
+    context = contextOf(coro);
+    return false;
+  }
+
+  taskContext const *await_resume() const noexcept { return context; }
+
+  taskContext const *context = nullptr;
+};
+
+// co_await setContext{&context} binds a context to this coroutine, the
+// tasks it awaits afterwards inherit it.
+// return the previous one, to restore it when the span ends
+struct setContext {
+  bool await_ready() const noexcept { return false; }
+
+  template <typename P>
+    requires std::derived_from<P, contextPromise>
+  bool await_suspend(std::coroutine_handle<P> coro) noexcept {
+    previous = coro.promise().context;
+    coro.promise().context = context;
+    return false;
+  }
+
+  taskContext const *await_resume() const noexcept { return previous; }
+
+  taskContext const *context = nullptr;
+  taskContext const *previous = nullptr;
+};
+
+} // namespace ACPAcoro
@@ -1,17 +1,187 @@
 #pragma once
 
+#include "async/Cancel.hpp"
 #include "async/Loop.hpp"
 #include "async/Tasks.hpp"
+#include "tl/expected.hpp"
 #include "utils/ErrorHandle.hpp"
 
+#include <atomic>
+#include <coroutine>
+#include <cstdint>
+#include <memory>
 #include <print>
 #include <ranges>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <vector>
 
 namespace ACPAcoro {
 
+// a coroutine waiting on a readinessSlot, lives in its awaiter
+struct readinessWaiter {
+  std::coroutine_handle<> coro = nullptr;
+  readinessWaiter *next = nullptr;
+};
+
+// readiness of one direction of a fd registered with persistent EPOLLET
+// the state is either empty, a ready mark left by an edge nobody waited for,
+// or the list of the coroutines waiting for the next edge, e.g. every
+// coroutine sharing the socket of a connection
+struct readinessSlot {
+
+  // called by the poller on an edge, resume(coro) every waiting coroutine.
+  // each retries its operation and waits again on EAGAIN
+  template <typename Resume> void notify(Resume &&resume) {
+    auto cur = state.load(std::memory_order::acquire);
+    while (true) {
+      if (cur == readyMark()) {
+        return;
+      }
+      auto next = cur == nullptr ? readyMark() : nullptr;
+      if (state.compare_exchange_weak(cur, next, std::memory_order::acq_rel)) {
+        break;
+      }
+    }
+    resumeAll(static_cast<readinessWaiter *>(cur), resume);
+  }
+
+  // resume(coro) every waiting coroutine without an edge, e.g. to let a
+  // cancelled one go. the others retry and wait again
+  template <typename Resume> void wakeAll(Resume &&resume) {
+    auto cur = state.load(std::memory_order::acquire);
+    while (cur != nullptr && cur != readyMark()) {
+      if (state.compare_exchange_weak(cur, nullptr,
+                                      std::memory_order::acq_rel)) {
+        resumeAll(static_cast<readinessWaiter *>(cur), resume);
+        return;
+      }
+    }
+  }
+
+  // consume the ready mark of an edge that came before the wait
+  bool consume() {
+    auto cur = readyMark();
+    return state.compare_exchange_strong(cur, nullptr,
+                                         std::memory_order::acq_rel);
+  }
+
+  // wait for the next edge
+  // return false if an edge came in between, the caller should not suspend
+  bool park(readinessWaiter &waiter) {
+    auto cur = state.load(std::memory_order::acquire);
+    while (true) {
+      if (cur == readyMark()) {
+        if (state.compare_exchange_weak(cur, nullptr,
+                                        std::memory_order::acq_rel)) {
+          return false;
+        }
+        continue;
+      }
+      waiter.next = static_cast<readinessWaiter *>(cur);
+      if (state.compare_exchange_weak(cur, &waiter,
+                                      std::memory_order::acq_rel)) {
+        return true;
+      }
+    }
+  }
+
+  static void *readyMark() { return reinterpret_cast<void *>(uintptr_t{1}); }
+
+  std::atomic<void *> state{nullptr};
+
+private:
+  template <typename Resume>
+  static void resumeAll(readinessWaiter *waiter, Resume &resume) {
+    while (waiter != nullptr) {
+      // the waiter lives in the frame of the coroutine, read it first
+      auto next = waiter->next;
+      resume(waiter->coro);
+      waiter = next;
+    }
+  }
+};
+
+struct ioWaiters {
+  readinessSlot reader;
+  readinessSlot writer;
+  // link of the retired list of the poller, see epollInstance::retire()
+  ioWaiters *nextRetired = nullptr;
+};
+
+// wait for the next edge of a direction
+// a cancel of the awaiting coroutine resumes it early with ECANCELED, so a
+// read or write waiting for its socket can lose a whenAny
+struct readinessAwaiter {
+  bool await_ready() { return slot.consume(); }
+
+  template <typename P> bool await_suspend(std::coroutine_handle<P> coro) {
+    waiter.coro = coro;
+
+    cancel = cancelSourceOf(coro);
+    if (cancel == nullptr) {
+      return slot.park(waiter);
+    }
+
+    pool = &threadPool::current();
+    cancelHook.self = this;
+    cancelHook.invoke = &cancelWait;
+    bool parked = false;
+    if (!cancel->attach(cancelHook, [&] {
+          parked = slot.park(waiter);
+          return parked;
+        })) {
+      cancelled = true;
+      return false;
+    }
+    return parked;
+  }
+
+  tl::expected<void, std::error_code> await_resume() {
+    if (cancel != nullptr) {
+      cancel->detach(cancelHook);
+    }
+    if (cancelled) {
+      return tl::unexpected(
+          std::make_error_code(std::errc::operation_canceled));
+    }
+    return {};
+  }
+
+  // the waiter can't be picked out of the lock-free list, all of them are
+  // woken and the others wait again
+  static void cancelWait(cancelCallback &callback) {
+    auto self = static_cast<readinessCancelHook &>(callback).self;
+    self->cancelled = true;
+    auto pool = self->pool;
+    self->slot.wakeAll(
+        [pool](std::coroutine_handle<> coro) { pool->addTask(coro); });
+  }
+
+  struct readinessCancelHook : cancelCallback {
+    readinessAwaiter *self = nullptr;
+  };
+
+  readinessSlot &slot;
+  readinessWaiter waiter{};
+  cancelSource *cancel = nullptr;
+  threadPool *pool = nullptr;
+  // read after the hook is detached, which orders it after the callback
+  bool cancelled = false;
+  readinessCancelHook cancelHook{};
+};
+
 struct epollInstance {
 
+  // epoll_event::data.ptr is either the address of a coroutine resumed on
+  // any event, the address of ioWaiters tagged with the lowest bit, or
+  // nullptr for the eventfd waking a blocked poller
+  static void *tagWaiters(ioWaiters *waiters) {
+    return reinterpret_cast<void *>(reinterpret_cast<uintptr_t>(waiters) |
+                                    waitersTag);
+  }
+
   auto addEvent(int fd, epoll_event *event) {
     // std::println("addEvent: fd: {}", fd);
     return checkError(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, event));
@@ -25,37 +195,198 @@ struct epollInstance {
     return checkError(epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr));
   }
 
+  // free the waiters of a fd deleted from the set, from any thread.
+  // the poller may still hold them in the events of its current batch, so
+  // they're freed once that batch is dispatched
+  void retire(std::unique_ptr<ioWaiters> waiters) {
+    auto node = waiters.release();
+    node->nextRetired = retired.load(std::memory_order::relaxed);
+    while (!retired.compare_exchange_weak(node->nextRetired, node,
+                                          std::memory_order::release,
+                                          std::memory_order::relaxed)) {
+    }
+  }
+
   void operator=(epollInstance &&) = delete;
 
   static constexpr int maxevents = 128;
 
+  // poll the events and queue the ready coroutines on the pool
+  // the poller stays on the worker it's started on and ends with the run of
+  // the pool, it has to be started again after a restart
   inline Task<> epollWaitEvent(int timeout = -1) {
 
     debug("Enter wait");
+    // the instance may be gone when a restarted pool resumes the poller,
+    // only the pool is known to outlive it
+    auto &owner = pool;
+    auto run = owner.generation();
     epoll_event events[epollInstance::maxevents];
-    while (true) {
+    while (!owner.stopped()) {
       // std::println("start epollWaitEvent");
 
-      int fds = epoll_wait(epfd, events, epollInstance::maxevents, timeout);
+      int fds = waitEvents(events, timeout);
 
       for (auto i : std::ranges::views::iota(0, fds)) {
         // std::println("epollWaitEvent: fd: {}", events[i].data.fd);
         // std::println("epollWaitEvent: events: {}", events[i].events);
-        pool.addTask(std::coroutine_handle<>::from_address(events[i].data.ptr));
+        dispatch(events[i], [&](std::coroutine_handle<> coro) {
+          owner.addTask(coro);
+        });
       }
+      freeRetired();
       // std::println("finished epollWaitEvent");
-      co_await pool.scheduler;
+      if (owner.stopped()) {
+        break;
+      }
+      co_await owner.scheduler;
+      if (owner.generation() != run) {
+        break;
+      }
     }
-    throw std::runtime_error("epollWaitEvent exited");
     co_return;
   }
+  // poll the events and resume the ready coroutines inline on this thread,
+  // used by the shards of shardedEpoll which are pinned to a worker each.
+  // the poller only blocks when the worker has nothing else queued, the
+  // tasks pushed to the worker wake it. like epollWaitEvent it ends with
+  // the run of the pool
+  inline Task<> epollRunInline(int timeout = -1) {
+
+    debug("Enter inline wait");
+    auto &owner = pool;
+    auto run = owner.generation();
+    epoll_event events[epollInstance::maxevents];
+    while (!owner.stopped()) {
+      int fds = waitEvents(events, timeout);
+
+      for (auto i : std::ranges::views::iota(0, fds)) {
+        dispatch(events[i], [](std::coroutine_handle<> coro) {
+          if (!coro.done()) {
+            coro.resume();
+          }
+        });
+      }
+      freeRetired();
+      if (owner.stopped()) {
+        break;
+      }
+      co_await owner.scheduler;
+      if (owner.generation() != run) {
+        break;
+      }
+    }
+    co_return;
+  }
+
+  threadPool &getPool() noexcept { return pool; }
+
   epollInstance(threadPool &p) : pool(p) {
     epfd = checkError(epoll_create1(0)).or_else(throwUnexpected).value();
+    wakeFd = checkError(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+                 .or_else(throwUnexpected)
+                 .value();
+    epoll_event event{.events = EPOLLIN | EPOLLET, .data = {.ptr = nullptr}};
+    addEvent(wakeFd, &event).or_else(throwUnexpected);
+  }
+
+  ~epollInstance() {
+    freeRetired();
+    ::close(wakeFd);
+    ::close(epfd);
   }
 
 private:
+  static constexpr uintptr_t waitersTag = 1;
+
+  // epoll_wait on the current worker, blocking only while it has nothing
+  // queued and no timer due
+  int waitEvents(epoll_event *events, int timeout) {
+    if (timeout == 0) {
+      return epoll_wait(epfd, events, maxevents, 0);
+    }
+    timeout = pool.parkPoller(wakeFd, timeout);
+    int fds = epoll_wait(epfd, events, maxevents, timeout);
+    if (timeout != 0) {
+      pool.unparkPoller();
+    }
+    return fds;
+  }
+
+  // retired before the batch returned by epoll_wait was dispatched, so no
+  // later batch holds them: their fds were deleted before the retire
+  void freeRetired() {
+    if (retired.load(std::memory_order::relaxed) == nullptr) {
+      return;
+    }
+    auto node = retired.exchange(nullptr, std::memory_order::acquire);
+    while (node != nullptr) {
+      delete std::exchange(node, node->nextRetired);
+    }
+  }
+
+  template <typename Resume>
+  void dispatch(epoll_event const &event, Resume &&resume) {
+    if (event.data.ptr == nullptr) {
+      // reset the counter, the wake itself is all it carries
+      std::uint64_t count;
+      [[maybe_unused]] auto bytes = ::read(wakeFd, &count, sizeof(count));
+      return;
+    }
+
+    auto ptr = reinterpret_cast<uintptr_t>(event.data.ptr);
+    if (!(ptr & waitersTag)) {
+      resume(std::coroutine_handle<>::from_address(event.data.ptr));
+      return;
+    }
+
+    auto waiters = reinterpret_cast<ioWaiters *>(ptr & ~waitersTag);
+    // errors and hang ups wake both directions
+    if (event.events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+      waiters->reader.notify(resume);
+    }
+    if (event.events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+      waiters->writer.notify(resume);
+    }
+  }
+
   int epfd;
+  // written by the pool to wake the poller blocked in epoll_wait
+  int wakeFd;
+  std::atomic<ioWaiters *> retired{nullptr};
+  threadPool &pool;
+};
+
+// one epoll instance per worker of the pool
+// every shard is polled by a coroutine pinned on its worker, which resumes
+// the ready coroutines inline instead of passing them to the pool queues.
+// a connection stays on the shard that accepted it.
+struct shardedEpoll {
+
+  shardedEpoll(threadPool &p) : pool(p) {
+    for (size_t i = 0; i < pool.size(); i++) {
+      shards.push_back(std::make_unique<epollInstance>(pool));
+    }
+  }
+
+  void operator=(shardedEpoll &&) = delete;
+
+  size_t size() const noexcept { return shards.size(); }
+
+  epollInstance &shard(size_t index) { return *shards[index]; }
+
+  // launch the pollers, shard i is polled on worker i
+  void run(int timeout = -1) {
+    for (size_t i = 0; i < shards.size(); i++) {
+      pool.spawnTo(i, shards[i]->epollRunInline(timeout).detach());
+    }
+  }
+
+  threadPool &getPool() noexcept { return pool; }
+
+private:
   threadPool &pool;
+  std::vector<std::unique_ptr<epollInstance>> shards;
 };
 
 // Wait for an event to occur on the epoll instance and add the task to the loop
@@ -0,0 +1,170 @@
+#pragma once
+
+#include "async/Cancel.hpp"
+#include "async/Context.hpp"
+#include "utils/ErrorHandle.hpp"
+
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+namespace ACPAcoro {
+
+template <typename T> class asyncGenerator;
+
+// promise of the producer, it keeps a pointer to the last yielded value
+template <typename T>
+struct asyncGeneratorPromise : cancellablePromise, contextPromise {
+  using valueType = std::remove_reference_t<T>;
+
+  // back to the consumer waiting in next()
+  struct yieldAwaiter {
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<>) const noexcept {
+      return consumer;
+    }
+    void await_resume() const noexcept {}
+
+    std::coroutine_handle<> consumer;
+  };
+
+  asyncGenerator<T> get_return_object() noexcept;
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  yieldAwaiter final_suspend() noexcept {
+    value = nullptr;
+    return {consumer};
+  }
+
+  // the yielded object lives in the frame of the producer until it's
+  // resumed, by the following next()
+  yieldAwaiter yield_value(valueType &v) noexcept {
+    value = std::addressof(v);
+    return {consumer};
+  }
+
+  yieldAwaiter yield_value(valueType &&v) noexcept {
+    value = std::addressof(v);
+    return {consumer};
+  }
+
+  void return_void() noexcept {}
+
+#if ACPACORO_EXCEPTIONS
+  void unhandled_exception() noexcept {
+    exception = std::current_exception();
+  }
+
+  void rethrowIfFailed() const {
+    if (exception) {
+      std::rethrow_exception(exception);
+    }
+  }
+
+  std::exception_ptr exception = nullptr;
+#else
+  void unhandled_exception() noexcept { std::terminate(); }
+
+  void rethrowIfFailed() const noexcept {}
+#endif
+
+  valueType *value = nullptr;
+  std::coroutine_handle<> consumer = nullptr;
+};
+
+// a coroutine producing a stream of values on demand
+//
+//   asyncGenerator<std::string_view> chunks(asyncSocket &socket);
+//
+//   auto gen = chunks(socket);
+//   while (auto chunk = co_await gen.next()) {
+//     co_await send(*chunk);
+//   }
+//
+// the producer runs until its next co_yield only when the consumer awaits
+// next(), so it never gets ahead by more than one value, and it may
+// co_await I/O in between. both sides hand over by symmetric transfer.
+// a value isn't copied, next() returns a pointer to the yielded object,
+// valid until the following next(), then nullptr once the producer ends.
+// the producer gets the cancel source and the context of the consumer,
+// its exception is rethrown by next()
+template <typename T> class [[nodiscard]] asyncGenerator {
+public:
+  using promise_type = asyncGeneratorPromise<T>;
+  using valueType = typename promise_type::valueType;
+
+  struct nextAwaiter {
+    bool await_ready() const noexcept { return !producer || producer.done(); }
+
+    // run the producer until its next co_yield or its end
+    template <typename P>
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<P> consumer) const noexcept {
+      auto &promise = producer.promise();
+      promise.consumer = consumer;
+      if (promise.cancel == nullptr) {
+        promise.cancel = cancelSourceOf(consumer);
+      }
+      if (promise.context == nullptr) {
+        promise.context = contextOf(consumer);
+      }
+      return producer;
+    }
+
+    valueType *await_resume() const {
+      if (!producer) {
+        return nullptr;
+      }
+      producer.promise().rethrowIfFailed();
+      return producer.done() ? nullptr : producer.promise().value;
+    }
+
+    std::coroutine_handle<promise_type> producer;
+  };
+
+  asyncGenerator(std::coroutine_handle<promise_type> coro) noexcept
+      : producer(coro) {}
+
+  asyncGenerator(asyncGenerator &&other) noexcept
+      : producer(std::exchange(other.producer, nullptr)) {}
+
+  asyncGenerator &operator=(asyncGenerator &&other) noexcept {
+    if (this != &other) {
+      if (producer) {
+        producer.destroy();
+      }
+      producer = std::exchange(other.producer, nullptr);
+    }
+    return *this;
+  }
+
+  asyncGenerator(asyncGenerator const &) = delete;
+  asyncGenerator &operator=(asyncGenerator const &) = delete;
+
+  // a producer suspended at a co_yield is destroyed with its frame,
+  // it must not be awaiting I/O, i.e. next() must not be pending
+  ~asyncGenerator() {
+    if (producer) {
+      producer.destroy();
+    }
+  }
+
+  // co_await next() returns a pointer to the next value,
+  // nullptr once the producer ends
+  nextAwaiter next() const noexcept { return {producer}; }
+
+  bool done() const noexcept { return !producer || producer.done(); }
+
+private:
+  std::coroutine_handle<promise_type> producer;
+};
+
+template <typename T>
+asyncGenerator<T> asyncGeneratorPromise<T>::get_return_object() noexcept {
+  return {std::coroutine_handle<asyncGeneratorPromise>::from_promise(*this)};
+}
+
+} // namespace ACPAcoro
@@ -1,17 +1,23 @@
 #pragma once
 
+#include "async/TimingWheel.hpp"
+#include "utils/Clock.hpp"
 #include "utils/DEBUG.hpp"
+#include "utils/ErrorHandle.hpp"
 #include <atomic>
 #include <barrier>
 #include <chrono>
+#include <climits>
 #include <condition_variable>
 #include <coroutine>
+#include <cstdint>
 #include <deque>
 #include <functional>
 #include <latch>
 #include <list>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <oneapi/tbb/concurrent_hash_map.h>
 #include <oneapi/tbb/concurrent_set.h>
 #include <oneapi/tbb/concurrent_vector.h>
@@ -25,6 +31,7 @@
 #include <tbb/concurrent_queue.h>
 #include <tbb/concurrent_set.h>
 #include <thread>
+#include <unistd.h>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
@@ -46,120 +53,361 @@ struct threadPool {
 private:
   struct threadTaskQueue {
     std::deque<std::coroutine_handle<>> tasks{};
+    // detached coroutines spawned on this queue,
+    // destroyed by the clean thread once they are done
+    std::vector<std::coroutine_handle<>> ownedTasks{};
+    // timers armed on this worker, the worker sleeps until the next deadline
+    timingWheel timers{};
     std::mutex mutex{};
     std::condition_variable_any cv{};
+    // eventfd of the poller blocking the worker, -1 if it's not blocked
+    // in one. the first task pushed meanwhile writes it and resets it
+    int wakeFd = -1;
   };
 
-  std::list<threadTaskQueue> queueList;
-  std::mutex queueListMutex;
+  // one queue per worker thread, the vector is never resized after
+  // construction so it can be read without lock
+  std::vector<std::unique_ptr<threadTaskQueue>> queues;
 
-  using queueListIter = decltype(queueList)::iterator;
-  queueListIter currentQueue;
-  std::mutex queueCounterMutex;
-  std::condition_variable_any queueListCV;
+  // round robin counter to pick a queue for tasks added from outside
+  std::atomic<size_t> nextQueue{0};
+  std::atomic<size_t> ownedCount{0};
 
   // TODO: this rw mutex does not prefer writer
   std::shared_mutex cleanWorkMutex;
 
   std::vector<std::jthread> threads;
 
-  // when a task is added, the adder will check if its already bound to a
-  // threadpool if so, it will get the mutex and add it to the queue if not, it
-  // will try to get a queue Counter mutex and add it to next and then add the
-  // task to the prev queue
+  // set by stop(), the workers and the clean thread leave their loop,
+  // reset by start()
+  std::atomic<bool> stopping{false};
+  // number of start() calls
+  std::atomic<size_t> runs{0};
+  std::mutex cleanSleepMutex;
+  std::condition_variable cleanSleepCv;
+
+  // when a task is added, it's pushed to a queue picked by a atomic round
+  // robin counter, only the mutex of the target queue is acquired.
+  // a task yielding with the scheduler stays on the queue of its worker.
   //
-  // When clean tasks start, the clean thread will check every binding in the
-  // map and move doneTasks to a per thread set.
-  // (unordered_map<queueListIter, set<coroutine_handle>>)
+  // a detached task is spawned with spawn(), which records it in the
+  // ownedTasks of the target queue.
   //
-  // The clean thread will check every thread queue and remove done tasks, and
-  // then destroy them.
-  std::unordered_map<std::coroutine_handle<>, queueListIter> taskBinding;
-  std::mutex bindingMutex;
-  std::condition_variable_any bindingCV;
+  // When clean tasks start, the clean thread will check the owned tasks of
+  // every queue, remove done tasks from the queue and then destroy them.
 
-  std::latch threadLaunchLatch;
+  // a latch can't be reset, each start() has its own
+  std::optional<std::latch> threadLaunchLatch;
 
-  struct iterHash {
-    auto operator()(const queueListIter &iter) const {
-      return std::hash<void *>()(&(*iter));
+  // the worker queue of the current thread, if it's a worker of this pool
+  static inline thread_local threadPool *localPool = nullptr;
+  static inline thread_local threadTaskQueue *localQueue = nullptr;
+  static inline thread_local size_t localIndex = 0;
+
+  threadTaskQueue &pickQueue() {
+    return *queues[nextQueue.fetch_add(1, std::memory_order::relaxed) %
+                   queues.size()];
+  }
+
+  void pushTask(threadTaskQueue &targetQueue, std::coroutine_handle<> task,
+                bool owned = false) {
+    std::unique_lock<decltype(targetQueue.mutex)> queueLock(targetQueue.mutex);
+
+    targetQueue.tasks.push_back(task);
+    if (owned) {
+      targetQueue.ownedTasks.push_back(task);
+      ownedCount.fetch_add(1, std::memory_order::relaxed);
     }
-  };
+    // debug("task add successful");
+    auto wakeFd = std::exchange(targetQueue.wakeFd, -1);
+
+    queueLock.unlock();
+    targetQueue.cv.notify_all();
+    wakePoller(wakeFd);
+  }
+
+  static void wakePoller(int wakeFd) {
+    if (wakeFd >= 0) {
+      std::uint64_t one = 1;
+      // the counter only overflows after 2^64 - 2 wakes
+      [[maybe_unused]] auto written = ::write(wakeFd, &one, sizeof(one));
+    }
+  }
 
 public:
   threadPool(size_t const threadCnt = std::thread::hardware_concurrency())
-      : threadLaunchLatch(threadCnt), scheduler(*this) {
+      : scheduler(*this) {
 
     if (!(threadCnt >= 1)) {
-      throw std::invalid_argument("Thread count cannot be greater than 0");
+      throwException(
+          std::invalid_argument("Thread count cannot be greater than 0"));
     }
 
-    auto threadTask = [&]() {
-      // debug("{} start", std::this_thread::get_id());
-      std::shared_lock<decltype(cleanWorkMutex)> cleanLock(cleanWorkMutex);
-      std::unique_lock<decltype(bindingMutex)> bindingLock(bindingMutex);
-      std::unique_lock<decltype(queueCounterMutex)> queueCounterLock(
-          queueCounterMutex);
+    for (size_t i = 0; i < threadCnt; i++) {
+      queues.push_back(std::make_unique<threadTaskQueue>());
+    }
 
-      std::unique_lock<decltype(queueListMutex)> listLock(queueListMutex);
-      auto &queue = queueList.emplace_back();
-      listLock.unlock();
+    start();
+  }
 
-      queueCounterLock.unlock();
-      bindingLock.unlock();
-      cleanLock.unlock();
+  // launch the workers, called by the constructor and again to restart the
+  // pool after stop(), e.g. by the next runtime on the default instance
+  // must not be called concurrently with stop()
+  void start() {
+    if (!threads.empty()) {
+      return;
+    }
+    stopping.store(false, std::memory_order::relaxed);
+    runs.fetch_add(1, std::memory_order::relaxed);
+    threadLaunchLatch.emplace(queues.size());
 
-      threadLaunchLatch.arrive_and_wait();
+    auto threadTask = [this](size_t index) {
+      // debug("{} start", std::this_thread::get_id());
+      auto &queue = *queues[index];
+      localPool = this;
+      localQueue = &queue;
+      localIndex = index;
+
+      threadLaunchLatch->arrive_and_wait();
 
-      while (true) {
+      while (!stopping.load(std::memory_order::relaxed)) {
         runTasks(queue);
       }
     };
 
-    for (size_t i = 0; i < threadCnt; i++) {
-      threads.emplace_back(threadTask);
+    for (size_t i = 0; i < queues.size(); i++) {
+      threads.emplace_back(threadTask, i);
     }
-
-    currentQueue = queueList.begin();
   }
 
+  ~threadPool() { stop(); }
+
+  threadPool(threadPool const &) = delete;
+  threadPool &operator=(threadPool const &) = delete;
+
+  // run the clean work on the calling thread until the pool is stopped
   void enter() { cleanTasks(); }
 
-  void addTask(std::coroutine_handle<> task) {
-    std::shared_lock<decltype(cleanWorkMutex)> cleanLock(cleanWorkMutex);
+  // let every worker finish its current task and join them. the queued
+  // tasks and timers are kept, they run again once start() is called.
+  // a worker blocked in a poller is woken through its eventfd, the poller
+  // leaves when it sees the pool stopped.
+  // must not be called from a worker of this pool
+  void stop() {
+    if (stopping.exchange(true, std::memory_order::relaxed)) {
+      return;
+    }
+    // notify under the lock, a worker checks the flag before sleeping
+    for (auto &queue : queues) {
+      std::scoped_lock<decltype(queue->mutex)> queueLock(queue->mutex);
+      queue->cv.notify_all();
+      wakePoller(std::exchange(queue->wakeFd, -1));
+    }
+    {
+      std::scoped_lock<decltype(cleanSleepMutex)> lock(cleanSleepMutex);
+      cleanSleepCv.notify_all();
+    }
+    for (auto &thread : threads) {
+      if (thread.joinable()) {
+        thread.join();
+      }
+    }
+    threads.clear();
+
+    // nothing runs anymore, free the detached tasks that are done,
+    // the stopped pollers included
+    std::scoped_lock<decltype(cleanWorkMutex)> cleanLock(cleanWorkMutex);
+    for (auto &queue : queues) {
+      std::unordered_set<std::coroutine_handle<>> doneTasks{};
+      std::erase_if(queue->ownedTasks, [&](auto &task) {
+        if (task.done()) {
+          doneTasks.insert(task);
+          return true;
+        }
+        return false;
+      });
+      std::erase_if(queue->tasks,
+                    [&](auto &task) { return doneTasks.contains(task); });
+      ownedCount.fetch_sub(doneTasks.size(), std::memory_order::relaxed);
+      for (auto &task : doneTasks) {
+        task.destroy();
+      }
+    }
+  }
 
-    queueListIter targetQueue;
+  bool stopped() const noexcept {
+    return stopping.load(std::memory_order::relaxed);
+  }
 
-    std::unique_lock<decltype(bindingMutex)> bindingLock(bindingMutex);
+  // changes with every start(), a task queued when the pool stopped and
+  // resumed by the next run sees a new generation
+  size_t generation() const noexcept {
+    return runs.load(std::memory_order::relaxed);
+  }
 
-    if (taskBinding.contains(task)) {
-      targetQueue = taskBinding.at(task);
-    } else {
-      // get the currentQueue and plus one to iter
-      std::unique_lock<decltype(queueCounterMutex)> queueCounterLock(
-          queueCounterMutex);
+  size_t size() const noexcept { return queues.size(); }
 
-      targetQueue = currentQueue;
-      currentQueue++;
+  // index of the worker running the current thread, or size() if the
+  // current thread is not a worker of this pool
+  size_t currentWorker() const noexcept {
+    return localPool == this ? localIndex : queues.size();
+  }
 
-      if (currentQueue == queueList.end()) [[unlikely]] {
-        currentQueue = queueList.begin();
-      }
-      queueCounterLock.unlock();
+  // the pool of the current worker thread, or the default instance
+  static threadPool &current() {
+    return localPool != nullptr ? *localPool : getInstance();
+  }
 
-      taskBinding[task] = targetQueue;
+  void addTask(std::coroutine_handle<> task) { pushTask(pickQueue(), task); }
+
+  // arm a timer on the current worker, or any worker outside the pool
+  // the coroutine of the node is queued when the deadline is reached
+  void addTimer(timerNode &node) {
+    auto &targetQueue = localPool == this ? *localQueue : pickQueue();
+
+    std::unique_lock<decltype(targetQueue.mutex)> queueLock(targetQueue.mutex);
+    node.owner = &targetQueue;
+    targetQueue.timers.insert(node);
+    // a blocked poller waits no later than the timers it knew of
+    auto wakeFd = std::exchange(targetQueue.wakeFd, -1);
+    queueLock.unlock();
+
+    // the worker may be sleeping until a later deadline
+    if (&targetQueue != localQueue) {
+      targetQueue.cv.notify_all();
     }
-    bindingLock.unlock();
+    wakePoller(wakeFd);
+  }
 
-    // add task to targetQueue
-    std::unique_lock<decltype(targetQueue->mutex)> queueLock(
-        targetQueue->mutex);
+  // disarm a timer
+  // return false if it's not armed or already expired
+  bool cancelTimer(timerNode &node) {
+    auto owner = static_cast<threadTaskQueue *>(node.owner);
+    if (owner == nullptr) {
+      return false;
+    }
 
-    targetQueue->tasks.push_back(task);
-    // debug("task add successful");
+    std::scoped_lock<decltype(owner->mutex)> queueLock(owner->mutex);
+    if (!node.linked()) {
+      return false;
+    }
+    owner->timers.cancel(node);
+    return true;
+  }
+
+  // choose the worker of a timer without arming it,
+  // so resetTimer can be called for it from any thread
+  void bindTimer(timerNode &node) {
+    node.owner = localPool == this ? localQueue : &pickQueue();
+  }
+
+  // move a bound timer to a new deadline, armed or not
+  void resetTimer(timerNode &node,
+                  std::chrono::steady_clock::time_point deadline) {
+    auto owner = static_cast<threadTaskQueue *>(node.owner);
 
+    std::unique_lock<decltype(owner->mutex)> queueLock(owner->mutex);
+    owner->timers.cancel(node);
+    node.deadline = deadline;
+    owner->timers.insert(node);
+    auto wakeFd = std::exchange(owner->wakeFd, -1);
     queueLock.unlock();
-    targetQueue->cv.notify_all();
+
+    if (owner != localQueue) {
+      owner->cv.notify_all();
+    }
+    wakePoller(wakeFd);
+  }
+
+  void addTaskTo(size_t worker, std::coroutine_handle<> task) {
+    pushTask(*queues[worker % queues.size()], task);
+  }
+
+  // schedule a detached coroutine, its frame is owned by the pool and
+  // destroyed by the clean thread once done
+  void spawn(std::coroutine_handle<> task) {
+    pushTask(pickQueue(), task, true);
+  }
+
+  void spawnTo(size_t worker, std::coroutine_handle<> task) {
+    pushTask(*queues[worker % queues.size()], task, true);
+  }
+
+  // queue on the current worker if there is one
+  void addTaskLocal(std::coroutine_handle<> task) {
+    if (localPool == this) {
+      pushTask(*localQueue, task);
+    } else {
+      addTask(task);
+    }
+  }
+
+  // spawn on the current worker if there is one
+  void spawnLocal(std::coroutine_handle<> task) {
+    if (localPool == this) {
+      pushTask(*localQueue, task, true);
+    } else {
+      spawn(task);
+    }
+  }
+
+  // whether the current worker has queued tasks,
+  // used by pollers to avoid blocking them
+  bool localTasksPending() {
+    if (localPool != this) {
+      return false;
+    }
+    std::scoped_lock<decltype(localQueue->mutex)> queueLock(localQueue->mutex);
+    return !localQueue->tasks.empty();
+  }
+
+  // called by a poller before blocking the current worker for up to
+  // timeout ms, -1 for no limit. return the timeout to wait with: 0 if the
+  // worker has tasks queued or the pool is stopping, otherwise no later
+  // than the next timer of the worker. until unparkPoller(), the tasks
+  // pushed to the worker and stop() write to wakeFd, an eventfd the poller
+  // must be waiting on as well
+  int parkPoller(int wakeFd, int timeout) {
+    if (localPool != this) {
+      return timeout;
+    }
+    std::scoped_lock<decltype(localQueue->mutex)> queueLock(localQueue->mutex);
+    if (!localQueue->tasks.empty() || stopped()) {
+      return 0;
+    }
+
+    auto deadline = localQueue->timers.nextDeadline();
+    if (deadline != timingWheel::clock::time_point::max()) {
+      auto left = std::chrono::ceil<std::chrono::milliseconds>(
+                      deadline - timingWheel::clock::now())
+                      .count();
+      if (left <= 0) {
+        return 0;
+      }
+      if (timeout < 0 || left < timeout) {
+        timeout = static_cast<int>(std::min<decltype(left)>(left, INT_MAX));
+      }
+    }
+    localQueue->wakeFd = wakeFd;
+    return timeout;
+  }
+
+  // the poller of the current worker is back from its wait
+  void unparkPoller() {
+    if (localPool != this) {
+      return;
+    }
+    std::scoped_lock<decltype(localQueue->mutex)> queueLock(localQueue->mutex);
+    localQueue->wakeFd = -1;
+  }
+
+  // take the ownership of a detached coroutine without scheduling it,
+  // e.g. a coroutine resumed by epoll events
+  void adopt(std::coroutine_handle<> task) {
+    auto &targetQueue = pickQueue();
+    std::scoped_lock<decltype(targetQueue.mutex)> queueLock(targetQueue.mutex);
+    targetQueue.ownedTasks.push_back(task);
+    ownedCount.fetch_add(1, std::memory_order::relaxed);
   }
 
   // run tasks for once
@@ -168,11 +416,32 @@ public:
     // big lock to make sure when the clean thread is running, no task will run
     std::shared_lock<decltype(cleanWorkMutex)> cleanLock(cleanWorkMutex);
 
+    coarseClock::refresh();
+
     std::unique_lock<decltype(taskQueue.mutex)> lock(taskQueue.mutex);
+    expireTimers(taskQueue);
     if (taskQueue.tasks.empty()) {
       // debug("Queue empty");
       cleanLock.unlock();
-      taskQueue.cv.wait(lock, [&] { return !taskQueue.tasks.empty(); });
+
+      // sleep until a task comes or the next timer expires
+      auto deadline = taskQueue.timers.nextDeadline();
+      if (deadline == timingWheel::clock::time_point::max()) {
+        // or a timer is armed from another thread
+        taskQueue.cv.wait(lock, [&] {
+          return !taskQueue.tasks.empty() || !taskQueue.timers.empty() ||
+                 stopped();
+        });
+      } else {
+        taskQueue.cv.wait_until(lock, deadline, [&] {
+          return !taskQueue.tasks.empty() ||
+                 taskQueue.timers.nextDeadline() < deadline || stopped();
+        });
+      }
+
+      // the cached time is stale after sleeping, and a coarse read may be
+      // still before the deadline we were woken for
+      coarseClock::sync();
 
       // avoid dead lock
       // example:
@@ -188,6 +457,11 @@ public:
       if (!cleanLock.try_lock()) {
         return;
       }
+
+      // woken by a timer, it's expired in the next round
+      if (taskQueue.tasks.empty() || stopped()) {
+        return;
+      }
     }
 
     // debug("get a task");
@@ -206,48 +480,54 @@ public:
     // debug("task run once");
   }
 
+  // queue the coroutines of expired timers, the queue lock must be held
+  void expireTimers(threadTaskQueue &taskQueue) {
+    if (taskQueue.timers.empty()) {
+      return;
+    }
+    taskQueue.timers.advance(
+        coarseClock::now(),
+        [&](timerNode &node) {
+          if (node.onExpire != nullptr) {
+            node.onExpire(node);
+          } else {
+            taskQueue.tasks.push_back(node.coro);
+          }
+        });
+  }
+
   void cleanTasks() {
     using namespace std::chrono_literals;
 
-    while (true) {
+    while (!stopped()) {
 
       std::unique_lock<decltype(cleanWorkMutex)> cleanLock(cleanWorkMutex);
 
-      if (taskBinding.size() < 10000) {
+      if (ownedCount.load(std::memory_order::relaxed) < 10000) {
         cleanLock.unlock();
         debug("nothing to clean, clean work sleep");
       } else {
-        std::unordered_map<queueListIter,
-                           std::unordered_set<std::coroutine_handle<>>,
-                           iterHash>
-            doneTasks{};
-
-        // add done tasks to a per thread map
-        // and remove it from taskBinding
-
-        std::erase_if(taskBinding, [&](auto &task) {
-          if (task.first.done()) {
-            doneTasks[task.second].insert(task.first);
-            return true;
-          }
-          return false;
-        });
 
-        // Now, process the done tasks
+        for (auto &queue : queues) {
+          std::unordered_set<std::coroutine_handle<>> doneTasks{};
 
-        for (auto &threadQue : doneTasks) {
-          auto &queue = *threadQue.first;
-          auto &taskSet = threadQue.second;
+          std::unique_lock<std::mutex> queueLock(queue->mutex);
 
-          std::unique_lock<std::mutex> queueLock(queue.mutex);
-          std::erase_if(queue.tasks, [&](auto &task) {
-            if (taskSet.contains(task)) {
+          // move done tasks to a set and remove them from the owned tasks
+          std::erase_if(queue->ownedTasks, [&](auto &task) {
+            if (task.done()) {
+              doneTasks.insert(task);
               return true;
             }
             return false;
           });
 
-          for (auto &task : taskSet) {
+          std::erase_if(queue->tasks,
+                        [&](auto &task) { return doneTasks.contains(task); });
+
+          ownedCount.fetch_sub(doneTasks.size(), std::memory_order::relaxed);
+
+          for (auto &task : doneTasks) {
             task.destroy();
           }
         }
@@ -257,7 +537,8 @@ public:
 
       } // cleanWork
 
-      std::this_thread::sleep_for(30s);
+      std::unique_lock<decltype(cleanSleepMutex)> sleepLock(cleanSleepMutex);
+      cleanSleepCv.wait_for(sleepLock, 30s, [&] { return stopped(); });
       debug("clean work wake up");
 
     } // while
@@ -267,7 +548,12 @@ public:
     bool await_ready() { return false; }
     void await_suspend(std::coroutine_handle<> handle) {
       // debug("schedule from a coroutine");
-      pool.addTask(handle);
+      // stay on the current worker if there is one
+      if (localPool == &pool) {
+        pool.pushTask(*localQueue, handle);
+      } else {
+        pool.addTask(handle);
+      }
     }
     void await_resume() {}
 
@@ -276,4 +562,3 @@ public:
 }; // threadPool
 
 } // namespace ACPAcoro
-//
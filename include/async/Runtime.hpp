@@ -0,0 +1,187 @@
+#pragma once
+
+#include "async/Loop.hpp"
+#include "async/Tasks.hpp"
+#include "async/Traits.hpp"
+#include "utils/ErrorHandle.hpp"
+
+#include <atomic>
+#include <climits>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <linux/futex.h>
+#include <optional>
+#include <stdexcept>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+
+namespace ACPAcoro {
+
+// one shot flag blocking threads on a futex until it's set
+//
+// set() wakes the address after the store, when the waiter may be gone
+// already, so the flag can live on the stack of the waiter: at worst it's
+// a spurious wake of whatever lives there next, which futex users tolerate
+struct futexFlag {
+  void wait() noexcept {
+    while (state.load(std::memory_order::acquire) == 0) {
+      syscall(SYS_futex, address(), FUTEX_WAIT_PRIVATE, 0, nullptr, nullptr,
+              0);
+    }
+  }
+
+  void set() noexcept {
+    auto addr = address();
+    state.store(1, std::memory_order::release);
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+  }
+
+  bool isSet() const noexcept {
+    return state.load(std::memory_order::acquire) != 0;
+  }
+
+private:
+  std::uint32_t *address() noexcept {
+    return reinterpret_cast<std::uint32_t *>(&state);
+  }
+
+  std::atomic<std::uint32_t> state = 0;
+};
+
+struct syncWaitStateBase {
+  futexFlag done;
+  std::exception_ptr exception = nullptr;
+};
+
+template <typename T> struct syncWaitState : syncWaitStateBase {
+  std::optional<typename nonVoidHelper<T>::type> value;
+};
+
+// promise of the coroutine running a task for syncWait
+// it sets the flag at the final suspend point, the frame is owned by the
+// blocked thread
+struct syncWaitPromise {
+  struct finalAwaiter {
+    bool await_ready() const noexcept { return false; }
+    // nothing of the frame is touched after the flag is set
+    void await_suspend(std::coroutine_handle<>) const noexcept {
+      auto &done = state.done;
+      done.set();
+    }
+    void await_resume() const noexcept {}
+
+    syncWaitStateBase &state;
+  };
+
+  template <typename... Args>
+  syncWaitPromise(syncWaitStateBase &state, Args &&...) : state(state) {}
+
+  Task<void, syncWaitPromise> get_return_object() noexcept {
+    return {std::coroutine_handle<syncWaitPromise>::from_promise(*this)};
+  }
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  finalAwaiter final_suspend() noexcept { return {state}; }
+  void return_void() noexcept {}
+  void unhandled_exception() noexcept {
+    state.exception = std::current_exception();
+  }
+
+  syncWaitStateBase &state;
+};
+
+template <typename T, typename P>
+Task<void, syncWaitPromise> syncWaitHelper(syncWaitState<T> &state,
+                                           Task<T, P> task) {
+  if constexpr (std::is_void_v<T>) {
+    co_await task;
+  } else {
+    state.value.emplace(co_await task);
+  }
+}
+
+// run the task on the pool and block the calling thread until it ends
+// return its value or rethrow its exception.
+// the thread sleeps on a futex meanwhile, it must not be a worker of the
+// pool, which could be the one the task needs
+template <typename T, typename P>
+T syncWait(Task<T, P> task, threadPool &pool = threadPool::getInstance()) {
+  if (pool.currentWorker() != pool.size()) {
+    throwException(
+        std::logic_error("syncWait called from a worker of the pool"));
+  }
+
+  syncWaitState<T> state;
+  auto helper = syncWaitHelper(state, std::move(task));
+  pool.addTask(helper.selfCoro);
+  state.done.wait();
+
+  if (state.exception) {
+    std::rethrow_exception(state.exception);
+  }
+  if constexpr (!std::is_void_v<T>) {
+    return std::move(*state.value);
+  }
+}
+
+// entry point of a program: a thread pool plus the thread cleaning up its
+// detached tasks, instead of turning main into the clean thread
+//
+//   int main() {
+//     runtime rt;
+//     rt.blockOn(co_main());  // e.g. start the servers
+//     rt.wait();              // until requestStop()
+//   }
+//
+// stop() stops the pool and joins the threads, so a server can be started
+// and stopped in-process, e.g. by a benchmark. the next runtime on the same
+// pool starts it again
+class runtime {
+public:
+  explicit runtime(threadPool &pool = threadPool::getInstance())
+      : pool(pool) {
+    pool.start();
+    cleaner = std::jthread([&pool] { pool.enter(); });
+  }
+
+  ~runtime() { stop(); }
+
+  runtime(runtime const &) = delete;
+  runtime &operator=(runtime const &) = delete;
+
+  template <typename T, typename P> T blockOn(Task<T, P> task) {
+    return syncWait(std::move(task), pool);
+  }
+
+  // block until requestStop(), then stop
+  void wait() {
+    stopRequest.wait();
+    stop();
+  }
+
+  // wake the thread in wait(), can be called from any thread,
+  // a coroutine on the pool included
+  void requestStop() noexcept { stopRequest.set(); }
+
+  // stop the pool and join the clean thread,
+  // called by the thread owning the runtime
+  void stop() {
+    stopRequest.set();
+    pool.stop();
+    if (cleaner.joinable()) {
+      cleaner.join();
+    }
+  }
+
+  threadPool &getPool() noexcept { return pool; }
+
+private:
+  threadPool &pool;
+  futexFlag stopRequest;
+  std::jthread cleaner;
+};
+
+} // namespace ACPAcoro
@@ -0,0 +1,198 @@
+#pragma once
+
+#include "async/Cancel.hpp"
+#include "async/Context.hpp"
+#include "async/Loop.hpp"
+#include "async/Tasks.hpp"
+#include "utils/DEBUG.hpp"
+#include "utils/ErrorHandle.hpp"
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+namespace ACPAcoro {
+
+class taskScope;
+
+// promise of the helper coroutine running a child of a taskScope
+// the helper destroys its own frame when the child ends, the last one
+// resumes the coroutine joining the scope
+struct scopePromise : cancellablePromise, contextPromise {
+  struct finalAwaiter {
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<> self) const noexcept;
+    void await_resume() const noexcept {}
+
+    taskScope &scope;
+  };
+
+  template <typename... Args> scopePromise(taskScope &scope, Args &&...);
+
+  Task<void, scopePromise> get_return_object() noexcept {
+    return {std::coroutine_handle<scopePromise>::from_promise(*this)};
+  }
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  finalAwaiter final_suspend() noexcept { return {scope}; }
+  void return_void() noexcept {}
+  void unhandled_exception() noexcept;
+
+  taskScope &scope;
+};
+
+// a nursery of child tasks bounded by the lifetime of their parent
+//
+//   taskScope scope(co_await currentCancel{});
+//   scope.spawn(child(socket));
+//   ...
+//   co_await scope.join();
+//
+// the children run on the thread pool, each frame is freed as soon as its
+// child ends. the first exception of a child cancels the other children
+// and is rethrown by join(). a cancel of the parent is forwarded to the
+// children, which also get the context given to the scope.
+// join() must be awaited once, after the last spawn, before the scope is
+// destroyed, destroying it with children running calls std::terminate().
+// withScope() joins on every path
+class taskScope {
+public:
+  struct joinAwaiter {
+    bool await_ready() const noexcept {
+      return scope.count.load(std::memory_order::acquire) == 1;
+    }
+
+    // drop the reference of the scope, the last child resumes the joiner
+    bool await_suspend(std::coroutine_handle<> coro) noexcept {
+      scope.joiner = coro;
+      return scope.count.fetch_sub(1, std::memory_order::acq_rel) != 1;
+    }
+
+    void await_resume() const {
+      scope.count.store(0, std::memory_order::relaxed);
+      if (scope.exception) {
+        std::rethrow_exception(scope.exception);
+      }
+    }
+
+    taskScope &scope;
+  };
+
+  explicit taskScope(cancelSource *parent = nullptr,
+                     threadPool &pool = threadPool::current(),
+                     taskContext const *context = nullptr)
+      : context(context), pool(pool), parentCancel(parent, source) {}
+
+  taskScope(taskScope const &) = delete;
+  taskScope &operator=(taskScope const &) = delete;
+
+  // the frames of running children point to the scope, they would touch
+  // it once freed, so like a joinable std::thread it terminates
+  ~taskScope() {
+    if (count.load(std::memory_order::acquire) > 1) {
+      errorlog("taskScope destroyed before joining its children");
+      std::terminate();
+    }
+  }
+
+  template <typename T, typename P> void spawn(Task<T, P> &&task) {
+    count.fetch_add(1, std::memory_order::relaxed);
+    pool.addTask(runChild(*this, std::move(task)).release());
+  }
+
+  // co_await join() returns when every child has ended,
+  // rethrow the first exception of a child
+  joinAwaiter join() noexcept { return {*this}; }
+
+  void cancel() { source.requestCancel(); }
+  bool cancelled() const noexcept { return source.cancelled(); }
+
+private:
+  friend struct scopePromise;
+
+  // the child is freed with the frame of the helper
+  template <typename T, typename P>
+  static Task<void, scopePromise> runChild(taskScope &, Task<T, P> task) {
+    co_await task;
+  }
+
+  // return the coroutine to resume after a child ends
+  std::coroutine_handle<> arrive() noexcept {
+    if (count.fetch_sub(1, std::memory_order::acq_rel) == 1) {
+      return joiner;
+    }
+    return std::noop_coroutine();
+  }
+
+  // keep the first exception and cancel the other children
+  void fail(std::exception_ptr e) noexcept {
+    if (!failed.test_and_set(std::memory_order::relaxed)) {
+      exception = std::move(e);
+      source.requestCancel();
+    }
+  }
+
+  // the children plus one held by the scope until it's joined
+  std::atomic<std::size_t> count = 1;
+  std::coroutine_handle<> joiner = nullptr;
+  std::atomic_flag failed = ATOMIC_FLAG_INIT;
+  std::exception_ptr exception = nullptr;
+  taskContext const *context;
+  threadPool &pool;
+  cancelSource source;
+  forwardCancel parentCancel;
+};
+
+template <typename... Args>
+scopePromise::scopePromise(taskScope &scope, Args &&...) : scope(scope) {
+  cancel = &scope.source;
+  context = scope.context;
+}
+
+inline void scopePromise::unhandled_exception() noexcept {
+  scope.fail(std::current_exception());
+}
+
+// the awaiter lives in the frame, nothing of it is touched after destroy()
+inline std::coroutine_handle<> scopePromise::finalAwaiter::await_suspend(
+    std::coroutine_handle<> self) const noexcept {
+  auto &owner = scope;
+  self.destroy();
+  return owner.arrive();
+}
+
+// run body(scope) and join the scope on every path
+// body: a callable returning a Task<> from a taskScope &
+// the exception of the body wins over the ones of the children
+template <typename F> Task<> withScope(F body) {
+  taskScope scope(co_await currentCancel{}, threadPool::current(),
+                  co_await currentContext{});
+#if ACPACORO_EXCEPTIONS
+  std::exception_ptr exception = nullptr;
+  try {
+    co_await body(scope);
+  } catch (...) {
+    exception = std::current_exception();
+    scope.cancel();
+  }
+
+  try {
+    co_await scope.join();
+  } catch (...) {
+    if (!exception) {
+      exception = std::current_exception();
+    }
+  }
+
+  if (exception) {
+    std::rethrow_exception(exception);
+  }
+#else
+  co_await body(scope);
+  co_await scope.join();
+#endif
+}
+
+} // namespace ACPAcoro
@@ -0,0 +1,319 @@
+#pragma once
+
+// synchronization between coroutines
+//
+// a coroutine that has to wait is parked on the primitive instead of
+// blocking its worker, and resumed on the thread pool when it's woken.
+// the state of each primitive is guarded by a std::mutex held for a few
+// pointer moves only, never across a suspension.
+// parked coroutines are woken with ECANCELED if they are cancelled.
+//
+#include "async/Loop.hpp"
+#include "async/WaitList.hpp"
+#include "tl/expected.hpp"
+
+#include <coroutine>
+#include <cstddef>
+#include <mutex>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+namespace ACPAcoro {
+
+// FIFO mutex, unlock() hands the ownership to the first parked coroutine
+// so a coroutine can't barge in and starve the parked ones
+class asyncMutex {
+  template <typename, typename> friend struct parkingAwaiter;
+
+public:
+  // unlocks on destruction
+  class guard {
+  public:
+    explicit guard(asyncMutex &mutex) : owner(&mutex) {}
+    guard(guard &&other) noexcept
+        : owner(std::exchange(other.owner, nullptr)) {}
+    guard &operator=(guard &&other) noexcept {
+      if (this != &other) {
+        unlock();
+        owner = std::exchange(other.owner, nullptr);
+      }
+      return *this;
+    }
+    ~guard() { unlock(); }
+
+    void unlock() {
+      if (owner != nullptr) {
+        std::exchange(owner, nullptr)->unlock();
+      }
+    }
+
+  private:
+    asyncMutex *owner;
+  };
+
+  struct lockAwaiter : parkingAwaiter<lockAwaiter, asyncMutex> {
+    tl::expected<void, std::error_code> await_resume() {
+      this->detachCancel();
+      if (this->error) {
+        return tl::unexpected(this->error);
+      }
+      return {};
+    }
+
+    // return true if parked
+    bool tryOrPark() {
+      auto &owner = this->owner;
+      std::scoped_lock<decltype(owner.mutex)> lock(owner.mutex);
+      if (!owner.locked) {
+        owner.locked = true;
+        return false;
+      }
+      owner.waiters.push(*this);
+      return true;
+    }
+
+    waiterList &list() { return this->owner.waiters; }
+
+    explicit lockAwaiter(asyncMutex &mutex)
+        : parkingAwaiter<lockAwaiter, asyncMutex>(mutex) {}
+  };
+
+  struct scopedLockAwaiter : lockAwaiter {
+    tl::expected<guard, std::error_code> await_resume() {
+      return lockAwaiter::await_resume().map(
+          [this] { return guard(this->owner); });
+    }
+
+    using lockAwaiter::lockAwaiter;
+  };
+
+  explicit asyncMutex(threadPool &pool = threadPool::current()) : pool(pool) {}
+
+  asyncMutex(asyncMutex const &) = delete;
+  asyncMutex &operator=(asyncMutex const &) = delete;
+
+  // co_await lock() returns ECANCELED if cancelled before owning the lock
+  lockAwaiter lock() { return lockAwaiter(*this); }
+
+  // co_await scopedLock() returns a guard owning the lock
+  scopedLockAwaiter scopedLock() { return scopedLockAwaiter(*this); }
+
+  bool tryLock() {
+    std::scoped_lock<decltype(mutex)> lock(mutex);
+    return !std::exchange(locked, true);
+  }
+
+  void unlock() {
+    std::coroutine_handle<> next = nullptr;
+    {
+      std::scoped_lock<decltype(mutex)> lock(mutex);
+      if (waiters.empty()) {
+        locked = false;
+        return;
+      }
+      next = waiters.pop().coro;
+    }
+    pool.addTask(next);
+  }
+
+private:
+  bool locked = false;
+  waiterList waiters;
+  std::mutex mutex;
+  threadPool &pool;
+};
+
+// counting semaphore, released permits go to the parked coroutines first
+//
+// also a limiter of in-flight work:
+//   asyncSemaphore inFlight(1024);
+//   auto permit = co_await inFlight.scoped();
+// holds a permit until the work is done and parks the next one meanwhile
+class asyncSemaphore {
+  template <typename, typename> friend struct parkingAwaiter;
+
+public:
+  // releases a permit on destruction
+  class permit {
+  public:
+    explicit permit(asyncSemaphore &semaphore) : owner(&semaphore) {}
+    permit(permit &&other) noexcept
+        : owner(std::exchange(other.owner, nullptr)) {}
+    permit &operator=(permit &&other) noexcept {
+      if (this != &other) {
+        release();
+        owner = std::exchange(other.owner, nullptr);
+      }
+      return *this;
+    }
+    ~permit() { release(); }
+
+    void release() {
+      if (owner != nullptr) {
+        std::exchange(owner, nullptr)->release();
+      }
+    }
+
+  private:
+    asyncSemaphore *owner;
+  };
+
+  struct acquireAwaiter : parkingAwaiter<acquireAwaiter, asyncSemaphore> {
+    tl::expected<void, std::error_code> await_resume() {
+      this->detachCancel();
+      if (this->error) {
+        return tl::unexpected(this->error);
+      }
+      return {};
+    }
+
+    // return true if parked
+    bool tryOrPark() {
+      auto &semaphore = this->owner;
+      std::scoped_lock<decltype(semaphore.mutex)> lock(semaphore.mutex);
+      if (semaphore.count > 0) {
+        semaphore.count--;
+        return false;
+      }
+      semaphore.waiters.push(*this);
+      return true;
+    }
+
+    waiterList &list() { return this->owner.waiters; }
+
+    explicit acquireAwaiter(asyncSemaphore &semaphore)
+        : parkingAwaiter<acquireAwaiter, asyncSemaphore>(semaphore) {}
+  };
+
+  struct scopedAwaiter : acquireAwaiter {
+    tl::expected<permit, std::error_code> await_resume() {
+      return acquireAwaiter::await_resume().map(
+          [this] { return permit(this->owner); });
+    }
+
+    using acquireAwaiter::acquireAwaiter;
+  };
+
+  explicit asyncSemaphore(std::size_t count,
+                          threadPool &pool = threadPool::current())
+      : count(count), pool(pool) {}
+
+  asyncSemaphore(asyncSemaphore const &) = delete;
+  asyncSemaphore &operator=(asyncSemaphore const &) = delete;
+
+  // co_await acquire() returns ECANCELED if cancelled before getting a permit
+  acquireAwaiter acquire() { return acquireAwaiter(*this); }
+
+  // co_await scoped() returns a permit released on destruction
+  scopedAwaiter scoped() { return scopedAwaiter(*this); }
+
+  bool tryAcquire() {
+    std::scoped_lock<decltype(mutex)> lock(mutex);
+    if (count == 0) {
+      return false;
+    }
+    count--;
+    return true;
+  }
+
+  void release(std::size_t n = 1) {
+    std::vector<std::coroutine_handle<>> woken;
+    {
+      std::scoped_lock<decltype(mutex)> lock(mutex);
+      for (; n > 0 && !waiters.empty(); n--) {
+        woken.push_back(waiters.pop().coro);
+      }
+      count += n;
+    }
+    for (auto coro : woken) {
+      pool.addTask(coro);
+    }
+  }
+
+  std::size_t available() {
+    std::scoped_lock<decltype(mutex)> lock(mutex);
+    return count;
+  }
+
+private:
+  std::size_t count;
+  waiterList waiters;
+  std::mutex mutex;
+  threadPool &pool;
+};
+
+// manual reset event, set() wakes every parked coroutine and lets the
+// following ones through until reset()
+class asyncEvent {
+  template <typename, typename> friend struct parkingAwaiter;
+
+public:
+  struct waitAwaiter : parkingAwaiter<waitAwaiter, asyncEvent> {
+    tl::expected<void, std::error_code> await_resume() {
+      this->detachCancel();
+      if (this->error) {
+        return tl::unexpected(this->error);
+      }
+      return {};
+    }
+
+    // return true if parked
+    bool tryOrPark() {
+      auto &event = this->owner;
+      std::scoped_lock<decltype(event.mutex)> lock(event.mutex);
+      if (event.signaled) {
+        return false;
+      }
+      event.waiters.push(*this);
+      return true;
+    }
+
+    waiterList &list() { return this->owner.waiters; }
+
+    explicit waitAwaiter(asyncEvent &event)
+        : parkingAwaiter<waitAwaiter, asyncEvent>(event) {}
+  };
+
+  explicit asyncEvent(bool signaled = false,
+                      threadPool &pool = threadPool::current())
+      : signaled(signaled), pool(pool) {}
+
+  asyncEvent(asyncEvent const &) = delete;
+  asyncEvent &operator=(asyncEvent const &) = delete;
+
+  // co_await wait() returns ECANCELED if cancelled before the event is set
+  waitAwaiter wait() { return waitAwaiter(*this); }
+
+  void set() {
+    std::vector<std::coroutine_handle<>> woken;
+    {
+      std::scoped_lock<decltype(mutex)> lock(mutex);
+      signaled = true;
+      while (!waiters.empty()) {
+        woken.push_back(waiters.pop().coro);
+      }
+    }
+    for (auto coro : woken) {
+      pool.addTask(coro);
+    }
+  }
+
+  void reset() {
+    std::scoped_lock<decltype(mutex)> lock(mutex);
+    signaled = false;
+  }
+
+  bool isSet() {
+    std::scoped_lock<decltype(mutex)> lock(mutex);
+    return signaled;
+  }
+
+private:
+  bool signaled;
+  waiterList waiters;
+  std::mutex mutex;
+  threadPool &pool;
+};
+
+} // namespace ACPAcoro
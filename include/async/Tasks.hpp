@@ -1,13 +1,18 @@
 #pragma once
 
+#include "async/Cancel.hpp"
+#include "async/Context.hpp"
 #include "async/Loop.hpp"
-#include <atomic>
+#include "tl/expected.hpp"
+#include "utils/ErrorHandle.hpp"
+#include <concepts>
 #include <coroutine>
+#include <cstddef>
 #include <exception>
-#include <print>
-#include <stdatomic.h>
+#include <optional>
 #include <stdexcept>
 #include <utility>
+#include <variant>
 
 namespace ACPAcoro {
 
@@ -18,35 +23,25 @@ struct returnPrevAwaiter {
 
   // return to previous coroutine if exists
   // else suspend always (return a noop coroutine)
+  // a detached coroutine stays suspended, the pool destroys it
   auto await_suspend(std::coroutine_handle<>) const noexcept
       -> std::coroutine_handle<> {
-    if (detached.test(std::memory_order::relaxed) &&
-        ended.test(std::memory_order::relaxed)) {
-      // it's the resumer's responsibility to destroy the coroutine
-      //
-      return std::noop_coroutine();
-    }
-
-    if (!detached.test() && prevCoro) {
+    if (!detached && prevCoro) {
       return prevCoro;
-    } else {
-      return std::noop_coroutine();
     }
+    return std::noop_coroutine();
   }
 
   void await_resume() const noexcept {}
 
-  returnPrevAwaiter(bool endedFlag, bool detachFlag,
-                    std::coroutine_handle<> prevCoro)
-      : ended(endedFlag), detached(detachFlag), prevCoro(prevCoro) {}
-
-  std::atomic_flag ended = ATOMIC_FLAG_INIT;
-  std::atomic_flag detached = ATOMIC_FLAG_INIT;
+  bool detached = false;
   std::coroutine_handle<> prevCoro = nullptr;
 };
 
 template <typename T> class promiseType;
 
+// owns the frame of its coroutine, it's destroyed with the task
+// unless the task is detached or released
 template <typename T = void, typename P = promiseType<T>>
 class [[nodiscard]] Task {
 public:
@@ -57,38 +52,59 @@ public:
 
     // return the value of the task
     // else rethrow the exception
-    T await_resume() const {
-      try {
-        return selfCoro.promise().getValue();
-      } catch (...) {
-        std::rethrow_exception(std::current_exception());
-      }
+    // noexcept for promises without exceptions, no unwinding path is emitted
+    T await_resume() const
+        noexcept(noexcept(std::declval<promise_type &>().getValue())) {
+      return selfCoro.promise().getValue();
     }
 
     // store the caller coroutine to the stack
     // and call the task coroutine (selfCoro)
-    auto await_suspend(std::coroutine_handle<> callerCoro) const noexcept
-        -> std::coroutine_handle<> {
-      selfCoro.promise().prevCoro = callerCoro;
+    // the task inherits the cancel source and the context of the caller
+    // if it has none
+    template <typename CallerPromise>
+    auto await_suspend(std::coroutine_handle<CallerPromise> callerCoro) const
+        noexcept -> std::coroutine_handle<> {
+      auto &promise = selfCoro.promise();
+      promise.prevCoro = callerCoro;
+      if (promise.cancel == nullptr) {
+        promise.cancel = cancelSourceOf(callerCoro);
+      }
+      if constexpr (std::derived_from<promise_type, contextPromise>) {
+        if (promise.context == nullptr) {
+          promise.context = contextOf(callerCoro);
+        }
+      }
       return selfCoro;
     }
 
     std::coroutine_handle<promise_type> selfCoro = nullptr;
   };
 
-  virtual ~Task() {
-    if (selfCoro) {
-      // selfCoro.destroy();
+  Task() noexcept = default;
+  Task(std::coroutine_handle<promise_type> coro) noexcept : selfCoro(coro) {}
+
+  Task(Task &&other) noexcept
+      : selfCoro(std::exchange(other.selfCoro, nullptr)) {}
+
+  Task &operator=(Task &&other) noexcept {
+    if (this != &other) {
+      if (selfCoro) {
+        selfCoro.destroy();
+      }
+      selfCoro = std::exchange(other.selfCoro, nullptr);
     }
+    return *this;
   }
-  Task(std::coroutine_handle<promise_type> coro = nullptr) : selfCoro(coro) {}
-  Task(Task const &&other)
-      : selfCoro(std::exchange(other.selfCoro, nullptr)) {};
 
-  operator std::coroutine_handle<>() const noexcept { return selfCoro; }
+  Task(Task const &) = delete;
+  Task &operator=(Task const &) = delete;
 
-  // if a exception is stored, rethrow it
-  // else return a value
+  ~Task() {
+    if (selfCoro) {
+      selfCoro.destroy();
+    }
+  }
 
   taskAwaiter operator co_await() const noexcept { return {selfCoro}; }
 
@@ -96,67 +112,145 @@ public:
     if (selfCoro) {
       selfCoro.resume();
     } else {
-      throw std::runtime_error("Task is empty");
+      throwException(std::runtime_error("Task is empty"));
     }
   }
 
-  std::coroutine_handle<> detach() {
-    selfCoro.promise().detached.test_and_set(std::memory_order::relaxed);
-    auto coro = selfCoro;
-    selfCoro = nullptr;
-    return coro;
+  // bind a context to the task, e.g. before detaching it as nothing passes
+  // it one then:
+  //   pool.spawn(handler(fd).withContext(co_await currentContext{}).detach());
+  Task &&withContext(taskContext const *context) && noexcept
+    requires std::derived_from<promise_type, contextPromise>
+  {
+    selfCoro.promise().context = context;
+    return std::move(*this);
+  }
+
+  // the coroutine ends on its own, its frame is owned by whoever resumes
+  // it, usually the pool through spawn()
+  std::coroutine_handle<> detach() noexcept {
+    selfCoro.promise().detached = true;
+    return release();
+  }
+
+  // give up the frame without changing how the coroutine ends,
+  // for promises whose coroutines free themselves or are freed by the caller
+  std::coroutine_handle<promise_type> release() noexcept {
+    return std::exchange(selfCoro, nullptr);
   }
 
   std::coroutine_handle<promise_type> selfCoro = nullptr;
 };
 
-class promiseBase {
+class promiseBase : public cancellablePromise, public contextPromise {
 public:
   using finalAwaiter = returnPrevAwaiter;
 
   auto initial_suspend() -> std::suspend_always { return {}; };
 
   auto final_suspend() noexcept -> finalAwaiter {
-    return {true, detached.test(std::memory_order::relaxed), prevCoro};
+    return {detached, prevCoro};
   }
 
-  void operator=(promiseBase const &&) = delete;
-  void unhandled_exception() noexcept {
-    if (detached.test(std::memory_order::relaxed)) {
+  // nothing awaits a detached coroutine to get its exception
+  void rethrowIfDetached() const {
+#if ACPACORO_EXCEPTIONS
+    if (detached) {
       std::rethrow_exception(std::current_exception());
     }
-    this->returnException = std::current_exception();
-  }
-
-  void getValue() const {
-    if (this->returnException) {
-      std::rethrow_exception(this->returnException);
-    }
+#endif
   }
 
-  std::exception_ptr returnException = nullptr;
-  std::atomic_flag detached = ATOMIC_FLAG_INIT;
+  bool detached = false;
   std::coroutine_handle<> prevCoro = nullptr;
 };
 
+// the value and the exception share the storage of the result,
+// T needs no default constructor.
+// without exceptions there is only room for the value
 template <typename T = void> class promiseType : public promiseBase {
 public:
   Task<T> get_return_object() noexcept {
     return Task<T>{std::coroutine_handle<promiseType>::from_promise(*this)};
   }
 
-  void return_value(T &&value) { returnValue = std::forward<T>(value); }
-  void yield_value(T &&value) { returnValue = std::forward<T>(value); }
+  template <typename U = T>
+    requires std::constructible_from<T, U &&>
+  void return_value(U &&value) {
+    result.template emplace<valueIndex>(std::forward<U>(value));
+  }
+
+#if ACPACORO_EXCEPTIONS
+  void unhandled_exception() {
+    rethrowIfDetached();
+    result.template emplace<exceptionIndex>(std::current_exception());
+  }
 
   T getValue() {
-    // if there is an exception, rethrow it
-    if (this->returnException) {
-      std::rethrow_exception(this->returnException);
+    if (result.index() == exceptionIndex) {
+      std::rethrow_exception(std::get<exceptionIndex>(result));
     }
-    return std::move(returnValue);
+    return std::move(std::get<valueIndex>(result));
   }
+#else
+  void unhandled_exception() noexcept { std::terminate(); }
 
-  T returnValue;
+  T getValue() noexcept { return std::move(std::get<valueIndex>(result)); }
+#endif
+
+private:
+  static constexpr std::size_t valueIndex = 1;
+
+#if ACPACORO_EXCEPTIONS
+  static constexpr std::size_t exceptionIndex = 2;
+
+  std::variant<std::monostate, T, std::exception_ptr> result;
+#else
+  std::variant<std::monostate, T> result;
+#endif
+};
+
+// tasks returning an expected report their errors through it.
+// without exceptions the frame keeps no exception_ptr and awaiting them has
+// no rethrow path. with exceptions, one escaping the task, e.g. a bad_alloc
+// of a callee, is still rethrown to the awaiter like any task
+template <typename T, typename E>
+class promiseType<tl::expected<T, E>> : public promiseBase {
+public:
+  Task<tl::expected<T, E>> get_return_object() noexcept {
+    return Task<tl::expected<T, E>>{
+        std::coroutine_handle<promiseType>::from_promise(*this)};
+  }
+
+  template <typename U = tl::expected<T, E>>
+    requires std::constructible_from<tl::expected<T, E>, U &&>
+  void return_value(U &&value) {
+    result.emplace(std::forward<U>(value));
+  }
+
+#if ACPACORO_EXCEPTIONS
+  void unhandled_exception() {
+    rethrowIfDetached();
+    exception = std::current_exception();
+  }
+
+  tl::expected<T, E> getValue() {
+    if (exception) {
+      std::rethrow_exception(exception);
+    }
+    return std::move(*result);
+  }
+#else
+  void unhandled_exception() noexcept { std::terminate(); }
+
+  tl::expected<T, E> getValue() noexcept { return std::move(*result); }
+#endif
+
+private:
+  std::optional<tl::expected<T, E>> result;
+#if ACPACORO_EXCEPTIONS
+  std::exception_ptr exception = nullptr;
+#endif
 };
 
 template <> class promiseType<void> : public promiseBase {
@@ -167,6 +261,26 @@ public:
   }
 
   void return_void() noexcept {};
+
+#if ACPACORO_EXCEPTIONS
+  void unhandled_exception() {
+    rethrowIfDetached();
+    exception = std::current_exception();
+  }
+
+  void getValue() const {
+    if (exception) {
+      std::rethrow_exception(exception);
+    }
+  }
+
+private:
+  std::exception_ptr exception = nullptr;
+#else
+  void unhandled_exception() noexcept { std::terminate(); }
+
+  void getValue() const noexcept {}
+#endif
 };
 
 struct getSelfAwaiter {
@@ -181,32 +295,6 @@ struct getSelfAwaiter {
 
   std::coroutine_handle<> selfCoro = nullptr;
 };
-// unused code for whenAll
-
-//  struct retPrevPromiseType;
-
-// struct retPrevTask : Task<> {
-//   using promise_type = retPrevPromiseType;
-//   retPrevTask(std::coroutine_handle<retPrevPromiseType> coro)
-//       : selfCoro(coro) {}
-
-//   virtual ~retPrevTask() {
-//     if (selfCoro) {
-//       selfCoro.destroy();
-//     }
-//   }
-
-//   std::coroutine_handle<retPrevPromiseType> selfCoro = nullptr;
-// };
-
-struct retPrevPromiseType : public promiseBase {
-  Task<void, retPrevPromiseType> get_return_object() noexcept {
-    return Task<void, retPrevPromiseType>{
-        std::coroutine_handle<retPrevPromiseType>::from_promise(*this)};
-  }
-
-  void return_value(std::coroutine_handle<> coro) noexcept { prevCoro = coro; }
-};
 
 template <typename T> struct yieldPromiseType : public promiseBase {
   Task<T, yieldPromiseType<T>> get_return_object() noexcept {
@@ -215,9 +303,8 @@ template <typename T> struct yieldPromiseType : public promiseBase {
   }
 
   auto yield_value(T v) noexcept {
-    returnValue = v;
-    return returnPrevAwaiter{false, detached.test(std::memory_order::relaxed),
-                             prevCoro};
+    returnValue = std::move(v);
+    return returnPrevAwaiter{detached, prevCoro};
   }
 
   T &getValue() {
@@ -227,13 +314,68 @@ template <typename T> struct yieldPromiseType : public promiseBase {
     return returnValue;
   }
 
-  void return_value(T &&v) noexcept {
-    ended.test_and_set();
-    returnValue = std::forward<T>(v);
+  void return_value(T &&v) noexcept { returnValue = std::forward<T>(v); }
+
+  void unhandled_exception() {
+    rethrowIfDetached();
+    returnException = std::current_exception();
   }
 
-  std::atomic_flag ended = ATOMIC_FLAG_INIT;
+  std::exception_ptr returnException = nullptr;
   T returnValue;
 };
 
+// a detached coroutine freeing its frame as soon as it ends,
+// nothing awaits it and the pool doesn't keep track of it
+//
+// it's created suspended, start() queues it on the pool and release()
+// hands it to whoever resumes it. if it's never started it's destroyed
+// with its object
+class [[nodiscard]] fireAndForget {
+public:
+  struct promise_type : cancellablePromise, contextPromise {
+    fireAndForget get_return_object() noexcept {
+      return {std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    // there is no one to rethrow to
+    void unhandled_exception() noexcept { std::terminate(); }
+  };
+
+  fireAndForget(std::coroutine_handle<promise_type> coro) noexcept
+      : coro(coro) {}
+
+  fireAndForget(fireAndForget &&other) noexcept
+      : coro(std::exchange(other.coro, nullptr)) {}
+
+  fireAndForget(fireAndForget const &) = delete;
+  fireAndForget &operator=(fireAndForget const &) = delete;
+  fireAndForget &operator=(fireAndForget &&) = delete;
+
+  ~fireAndForget() {
+    if (coro) {
+      coro.destroy();
+    }
+  }
+
+  void start(threadPool &pool = threadPool::current()) && {
+    pool.addTask(release());
+  }
+
+  std::coroutine_handle<> release() noexcept {
+    return std::exchange(coro, nullptr);
+  }
+
+private:
+  std::coroutine_handle<promise_type> coro;
+};
+
+// run a task as a fireAndForget, both frames are freed when it ends
+template <typename T, typename P> fireAndForget forget(Task<T, P> task) {
+  co_await task;
+}
+
 } // namespace ACPAcoro
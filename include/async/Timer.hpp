@@ -1,35 +1,87 @@
 #pragma once
 
+#include "async/Cancel.hpp"
 #include "async/Loop.hpp"
 #include "async/Tasks.hpp"
+#include "async/TimingWheel.hpp"
+#include "utils/Clock.hpp"
 
 #include <chrono>
 #include <coroutine>
 namespace ACPAcoro {
 
+// suspend until the time point, the timer is armed on the wheel of the
+// current worker and the coroutine is queued there when it expires.
+// a cancel of the awaiting coroutine disarms the timer and resumes it early
 struct timerAwaiter {
   auto await_ready() const noexcept -> bool {
-    return time < std::chrono::system_clock::now();
+    return node.deadline <= coarseClock::now();
   }
 
-  auto await_suspend(std::coroutine_handle<> coro) const noexcept
-      -> std::coroutine_handle<> {
-    if (callBackCoro != nullptr) {
-      coro = callBackCoro;
+  template <typename P>
+  bool await_suspend(std::coroutine_handle<P> coro) noexcept {
+    // resume the call back coroutine instead if there is one
+    node.coro = callBackCoro != nullptr ? callBackCoro : coro;
+
+    cancel = cancelSourceOf(coro);
+    if (cancel == nullptr) {
+      pool.addTimer(node);
+      return true;
+    }
+
+    cancelHook.self = this;
+    cancelHook.invoke = &cancelTimer;
+    return cancel->attach(cancelHook, [&] {
+      pool.addTimer(node);
+      return true;
+    });
+  }
+
+  void await_resume() noexcept {
+    if (cancel != nullptr) {
+      cancel->detach(cancelHook);
+    }
+  }
+
+  timerAwaiter(std::chrono::steady_clock::time_point time,
+               std::coroutine_handle<> callBack = nullptr,
+               threadPool &targetPool = threadPool::current())
+      : callBackCoro(callBack), pool(targetPool) {
+    node.deadline = time;
+  }
+
+  // the frame is destroyed before the timer expires
+  ~timerAwaiter() {
+    if (node.linked()) {
+      pool.cancelTimer(node);
+    }
+  }
+
+  timerAwaiter(timerAwaiter const &) = delete;
+  timerAwaiter &operator=(timerAwaiter const &) = delete;
+
+  // resume the coroutine now if the timer hasn't expired yet
+  static void cancelTimer(cancelCallback &callback) {
+    auto self = static_cast<timerCancelHook &>(callback).self;
+    if (self->pool.cancelTimer(self->node)) {
+      self->pool.addTask(self->node.coro);
     }
-    // loopInstance::getInstance().addTimer(coro, time);
-    return std::noop_coroutine();
   }
 
-  void await_resume() const noexcept {}
+  struct timerCancelHook : cancelCallback {
+    timerAwaiter *self = nullptr;
+  };
 
   std::coroutine_handle<> callBackCoro = nullptr;
-  std::chrono::system_clock::time_point time;
+  threadPool &pool;
+  timerNode node;
+  cancelSource *cancel = nullptr;
+  timerCancelHook cancelHook;
 };
 
-Task<> sleepUntil(std::chrono::system_clock::time_point,
+Task<> sleepUntil(std::chrono::steady_clock::time_point,
                   std::coroutine_handle<> = nullptr);
-Task<> sleepFor(std::chrono::system_clock::duration,
+Task<> sleepFor(std::chrono::steady_clock::duration,
                 std::coroutine_handle<> = nullptr);
 
 } // namespace ACPAcoro
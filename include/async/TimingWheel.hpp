@@ -0,0 +1,227 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+
+namespace ACPAcoro {
+
+// intrusive timer entry, lives in the awaiter of the sleeping coroutine
+// so arming a timer never allocates
+struct timerNode {
+  bool linked() const noexcept { return pprev != nullptr; }
+
+  std::chrono::steady_clock::time_point deadline{};
+  std::coroutine_handle<> coro = nullptr;
+
+  // called instead of queuing coro when the timer expires,
+  // it runs on the owner worker with the queue lock held so it must be short
+  void (*onExpire)(timerNode &) = nullptr;
+
+  // the worker queue whose wheel holds the node, set by the thread pool
+  void *owner = nullptr;
+
+private:
+  friend struct timingWheel;
+
+  // pprev points to the pointer pointing to this node (slot head or
+  // prev->next), so a node can be unlinked without knowing its neighbours
+  timerNode **pprev = nullptr;
+  timerNode *next = nullptr;
+  uint64_t expireTick = 0;
+  uint16_t slot = 0;
+};
+
+// hierarchical timing wheel with 1ms ticks
+//
+// 4 levels of 64 slots cover 2^24 ms (about 4.6 hours), level L holds the
+// timers expiring within 64^(L+1) ticks. when the tick crosses the boundary
+// of a level, the slot of that level is cascaded to the lower levels.
+// farther timers wait in the last level and are placed again on cascade.
+//
+// insert and cancel are O(1), not thread safe
+struct timingWheel {
+  using clock = std::chrono::steady_clock;
+
+  static constexpr unsigned slotBits = 6;
+  static constexpr unsigned slotCnt = 1u << slotBits;
+  static constexpr unsigned levelCnt = 4;
+
+  timingWheel() : base(clock::now()) {}
+
+  timingWheel(timingWheel const &) = delete;
+  timingWheel &operator=(timingWheel const &) = delete;
+
+  // the timer fires at the first tick at or after its deadline
+  void insert(timerNode &node) {
+    node.expireTick = ceilTick(node.deadline);
+    if (node.expireTick <= currentTick) {
+      node.expireTick = currentTick + 1;
+    }
+    place(node);
+    count++;
+  }
+
+  void cancel(timerNode &node) {
+    if (node.linked()) {
+      unlink(node);
+      count--;
+    }
+  }
+
+  bool empty() const noexcept { return count == 0; }
+  size_t size() const noexcept { return count; }
+
+  // the time of the next tick with timers to expire or cascade
+  // time_point::max() if there is no timer
+  clock::time_point nextDeadline() const {
+    if (count == 0) {
+      return clock::time_point::max();
+    }
+
+    uint64_t next = UINT64_MAX;
+    for (unsigned level = 0; level < levelCnt; level++) {
+      if (bitmaps[level] == 0) {
+        continue;
+      }
+      auto shift = slotBits * level;
+      auto currentIndex = (currentTick >> shift) & (slotCnt - 1);
+      // the current slot itself comes back after a whole round
+      auto distance =
+          std::countr_zero(std::rotr(bitmaps[level],
+                                     static_cast<int>(currentIndex + 1))) +
+          1;
+      next = std::min(next, ((currentTick >> shift) + distance) << shift);
+    }
+    return base + std::chrono::milliseconds(next);
+  }
+
+  // move the wheel to now and call expire(node) for every due timer,
+  // the node is unlinked before the call
+  template <typename F> void advance(clock::time_point now, F &&expire) {
+    auto nowTick = floorTick(now);
+
+    while (currentTick < nowTick) {
+      if (count == 0) {
+        currentTick = nowTick;
+        break;
+      }
+
+      if (bitmaps[0] == 0) {
+        // nothing in the lowest level, jump to the next cascade
+        auto nextCascade = (currentTick | (slotCnt - 1)) + 1;
+        if (nextCascade > nowTick) {
+          currentTick = nowTick;
+          break;
+        }
+        currentTick = nextCascade;
+      } else {
+        currentTick++;
+      }
+
+      // top down, so cascaded timers land in levels handled later
+      for (unsigned level = levelCnt - 1; level > 0; level--) {
+        auto shift = slotBits * level;
+        if ((currentTick & ((uint64_t{1} << shift) - 1)) == 0) {
+          cascade(level * slotCnt + ((currentTick >> shift) & (slotCnt - 1)));
+        }
+      }
+
+      auto head = takeSlot(currentTick & (slotCnt - 1));
+      while (head != nullptr) {
+        auto node = head;
+        head = head->next;
+        node->pprev = nullptr;
+        node->next = nullptr;
+        count--;
+        expire(*node);
+      }
+    }
+  }
+
+private:
+  uint64_t floorTick(clock::time_point time) const {
+    if (time <= base) {
+      return 0;
+    }
+    return std::chrono::duration_cast<std::chrono::milliseconds>(time - base)
+        .count();
+  }
+
+  uint64_t ceilTick(clock::time_point time) const {
+    if (time <= base) {
+      return 0;
+    }
+    return std::chrono::ceil<std::chrono::milliseconds>(time - base).count();
+  }
+
+  void place(timerNode &node) {
+    auto delta = node.expireTick - currentTick;
+    auto expire = node.expireTick;
+
+    unsigned level = 0;
+    while (level + 1 < levelCnt &&
+           delta >= (uint64_t{1} << (slotBits * (level + 1)))) {
+      level++;
+    }
+
+    // out of range, wait in the farthest slot and get placed again
+    constexpr auto range = uint64_t{1} << (slotBits * levelCnt);
+    if (delta >= range) {
+      expire = currentTick + range - 1;
+    }
+
+    link(node, level * slotCnt +
+                   ((expire >> (slotBits * level)) & (slotCnt - 1)));
+  }
+
+  void link(timerNode &node, unsigned slot) {
+    node.slot = slot;
+    node.next = slots[slot];
+    if (node.next != nullptr) {
+      node.next->pprev = &node.next;
+    }
+    node.pprev = &slots[slot];
+    slots[slot] = &node;
+    bitmaps[slot / slotCnt] |= uint64_t{1} << (slot % slotCnt);
+  }
+
+  void unlink(timerNode &node) {
+    *node.pprev = node.next;
+    if (node.next != nullptr) {
+      node.next->pprev = node.pprev;
+    }
+    if (slots[node.slot] == nullptr) {
+      bitmaps[node.slot / slotCnt] &= ~(uint64_t{1} << (node.slot % slotCnt));
+    }
+    node.pprev = nullptr;
+    node.next = nullptr;
+  }
+
+  timerNode *takeSlot(unsigned slot) {
+    auto head = slots[slot];
+    slots[slot] = nullptr;
+    bitmaps[slot / slotCnt] &= ~(uint64_t{1} << (slot % slotCnt));
+    return head;
+  }
+
+  void cascade(unsigned slot) {
+    auto head = takeSlot(slot);
+    while (head != nullptr) {
+      auto node = head;
+      head = head->next;
+      place(*node);
+    }
+  }
+
+  clock::time_point base;
+  uint64_t currentTick = 0;
+  size_t count = 0;
+  std::array<uint64_t, levelCnt> bitmaps{};
+  std::array<timerNode *, slotCnt * levelCnt> slots{};
+};
+
+} // namespace ACPAcoro
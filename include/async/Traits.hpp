@@ -2,15 +2,20 @@
 
 #include <concepts>
 #include <coroutine>
+#include <type_traits>
 
 namespace ACPAcoro {
 
+// await_suspend may return void, bool or a coroutine to transfer to
+template <typename T>
+concept awaitSuspendResult =
+    std::is_void_v<T> || std::same_as<T, bool> ||
+    std::convertible_to<T, std::coroutine_handle<>>;
+
 template <typename A>
 concept Awaiter = requires(A a) {
   { a.await_ready() } -> std::convertible_to<bool>;
-  {
-    a.await_suspend(std::coroutine_handle<>())
-  } -> std::convertible_to<std::coroutine_handle<>>;
+  { a.await_suspend(std::coroutine_handle<>()) } -> awaitSuspendResult;
   { a.await_resume() };
 };
 
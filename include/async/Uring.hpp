@@ -1,9 +1,11 @@
 #pragma once
 
+#include "async/Cancel.hpp"
 #include "async/Loop.hpp"
 #include "async/Tasks.hpp"
 #include "tl/expected.hpp"
 #include "utils/DEBUG.hpp"
+#include "utils/ErrorHandle.hpp"
 #include <atomic>
 #include <cerrno>
 #include <functional>
@@ -131,6 +133,9 @@ inline std::error_code make_error_code(uringErr e) {
   return {static_cast<int>(e), uringErrCategory()};
 }
 
+// one address per awaiter type, identifying its multishotHandler
+template <typename A> inline constexpr char dispatchTag = 0;
+
 struct uringInstance {
 
   static constexpr int MAX_ENTRIES = 1024;
@@ -153,7 +158,7 @@ struct uringInstance {
     if (returnVal < 0) {
       if (returnVal == -EPERM)
         debug("Failed to initialize uring: Permission denied");
-      throw std::runtime_error("Failed to initialize uring");
+      throwException(std::runtime_error("Failed to initialize uring"));
     }
     uringFd = uring.ring_fd;
   }
@@ -164,11 +169,31 @@ struct uringInstance {
     bool multishot;
     std::coroutine_handle<> handle;
     tl::expected<int, std::error_code> returnVal;
-    std::function<Task<>(int)> multishotHandler;
+    // called with handlerContext and the result of every successful cqe of a
+    // multishot request, returns the coroutine to queue, a released
+    // fireAndForget freeing itself
+    std::coroutine_handle<> (*multishotHandler)(void *, int) = nullptr;
+    void *handlerContext = nullptr;
+    // &dispatchTag<A> of the awaiter A setting multishotHandler, a reaper
+    // knowing A calls A::invokeHandler directly instead
+    void const *handlerType = nullptr;
+    // set for the receiving end of IORING_OP_MSG_RING, every message runs
+    // a multishotHandler task on the reaper and the handle is never resumed
+    bool mailbox = false;
+    // set for IORING_OP_TIMEOUT, an expiry (-ETIME) is reported as success
+    bool timer = false;
+    // worker of the pool submitting the request, or the size of the pool
+    std::size_t worker = 0;
   };
 
-  Task<> reapIOs() {
+  // the multishot completions of the awaiters listed in Dispatchers are
+  // handled with a direct, inlinable call, the others through
+  // multishotHandler, e.g.
+  //   uring.reapIOs<multishotAcceptAwaiter<decltype(onAccept)>>()
+  template <typename... Dispatchers> Task<> reapIOs() {
     debug("Ready to reapIOs");
+    // completions left to resume inline before the ring is drained
+    auto inlineLeft = inlineBudget;
     while (true) {
       io_uring_cqe *cqe = nullptr;
       int ret = io_uring_peek_cqe(&uring, &cqe);
@@ -178,21 +203,33 @@ struct uringInstance {
           if (cqe != nullptr) {
             io_uring_cqe_seen(&uring, cqe);
           }
+          inlineLeft = inlineBudget;
           co_await pool.scheduler;
           continue;
         } else {
           errorlog("Failed to wait for cqe: {}",
                    std::generic_category().message(-ret));
 
-          throw std::system_error(-ret, std::generic_category());
+          throwException(std::system_error(-ret, std::generic_category()));
         }
       } else if (cqe == nullptr) {
+        inlineLeft = inlineBudget;
         co_await pool.scheduler;
         continue;
       } else {
 
         auto caller = reinterpret_cast<userData *>(io_uring_cqe_get_data(cqe));
 
+        // requests without a waiter, e.g. cancels
+        if (caller == nullptr) {
+          io_uring_cqe_seen(&uring, cqe);
+          continue;
+        }
+
+        if (caller->timer && cqe->res == -ETIME) {
+          cqe->res = 0;
+        }
+
         if (cqe->res < 0) {
           caller->returnVal = tl::unexpected(
               std::error_code(-cqe->res, std::generic_category()));
@@ -200,27 +237,79 @@ struct uringInstance {
           caller->returnVal = cqe->res;
         }
 
-        if (!caller->multishot) {
-          pool.addTask(caller->handle);
+        // the coroutine waiting for the request, if it ends with this cqe
+        std::coroutine_handle<> done = nullptr;
+        // the handler of a message, run here rather than queued
+        std::coroutine_handle<> message = nullptr;
+        if (caller->mailbox) {
+          // message posted by another ring
+          if (cqe->res >= 0) {
+            message = invokeHandler<Dispatchers...>(*caller, cqe->res);
+          }
+        } else if (!caller->multishot) {
+          done = caller->handle;
 
           // deal with multishot request
         } else {
-          // add a task for each successful request
+          // add a task for each successful request, spread over the
+          // workers in turn
           if (cqe->res >= 0) {
-            pool.addTask(caller->multishotHandler(cqe->res).detach());
+            pool.addTaskTo(nextWorker++ % pool.size(),
+                           invokeHandler<Dispatchers...>(*caller, cqe->res));
           }
 
           // if it's the last, resume the caller
           if (!(cqe->flags & IORING_CQE_F_MORE)) {
-            pool.addTask(caller->handle);
+            done = caller->handle;
           }
         }
 
         io_uring_cqe_seen(&uring, cqe);
+
+        // the message was posted to this ring, so this worker, and runs
+        // until its first suspension point without a trip through a queue
+        if (message) {
+          message.resume();
+        }
+
+        // caller lives in the frame of done, it can't be touched after this
+        if (done) {
+          complete(done, caller->worker, inlineLeft);
+        }
       }
     }
   }
 
+  // how reapIOs resumes the coroutine of a finished request
+  enum class completionPolicy {
+    // queue it on any worker
+    queued,
+    // queue it on the worker that submitted the request, where its frame
+    // is likely still in cache
+    owner,
+    // resume it on the reaping worker, up to inlineBudget completions in a
+    // row, then queue the rest on their owner until the ring is drained
+    inlineFirst,
+  };
+
+  struct completionStats {
+    std::size_t inlined;
+    std::size_t queued;
+  };
+
+  // must be called before reapIOs is started
+  void setCompletionPolicy(completionPolicy policy,
+                           std::size_t inlineBudget = 16) noexcept {
+    this->policy = policy;
+    this->inlineBudget = inlineBudget;
+  }
+
+  // number of completions resumed on the reaper and queued, so far
+  completionStats stats() const noexcept {
+    return {resumedInline.load(std::memory_order::relaxed),
+            resumedQueued.load(std::memory_order::relaxed)};
+  }
+
   tl::expected<void, std::error_code>
   prep_send(int fd, const void *buf, size_t len, int flags, userData *usr) {
     std::scoped_lock<decltype(uringAddMutex)> lock(uringAddMutex);
@@ -229,7 +318,7 @@ struct uringInstance {
     if (sqe == nullptr) {
       return tl::unexpected(make_error_code(uringErr::sqeBusy));
     }
-    io_uring_sqe_set_data(sqe, usr);
+    setData(sqe, usr);
 
     io_uring_prep_send(sqe, fd, buf, len, flags);
 
@@ -246,7 +335,7 @@ struct uringInstance {
     if (sqe == nullptr) {
       return tl::unexpected(make_error_code(uringErr::sqeBusy));
     }
-    io_uring_sqe_set_data(sqe, usr);
+    setData(sqe, usr);
 
     io_uring_prep_recv(sqe, fd, buf, len, flags);
 
@@ -262,7 +351,7 @@ struct uringInstance {
     if (sqe == nullptr) {
       return tl::unexpected(make_error_code(uringErr::sqeBusy));
     }
-    io_uring_sqe_set_data(sqe, usr);
+    setData(sqe, usr);
 
     io_uring_prep_multishot_accept(sqe, fd, addr, len, flags);
 
@@ -271,13 +360,183 @@ struct uringInstance {
     return {};
   }
 
+  tl::expected<void, std::error_code> prep_connect(int fd, sockaddr const *addr,
+                                                   socklen_t len,
+                                                   userData *usr) {
+    std::scoped_lock<decltype(uringAddMutex)> lock(uringAddMutex);
+    io_uring_sqe *sqe = io_uring_get_sqe(&uring);
+    if (sqe == nullptr) {
+      return tl::unexpected(make_error_code(uringErr::sqeBusy));
+    }
+    setData(sqe, usr);
+
+    io_uring_prep_connect(sqe, fd, addr, len);
+
+    io_uring_submit(&uring);
+
+    return {};
+  }
+
+  // cancel the request of target, it completes with ECANCELED if it's
+  // still in flight. the completion of the cancel itself is dropped
+  tl::expected<void, std::error_code> prep_cancel(userData *target) {
+    std::scoped_lock<decltype(uringAddMutex)> lock(uringAddMutex);
+    io_uring_sqe *sqe = io_uring_get_sqe(&uring);
+    if (sqe == nullptr) {
+      return tl::unexpected(make_error_code(uringErr::sqeBusy));
+    }
+    io_uring_prep_cancel(sqe, target, 0);
+    io_uring_sqe_set_data(sqe, nullptr);
+
+    io_uring_submit(&uring);
+
+    return {};
+  }
+
+  // the timespec has to live until the timeout completes
+  // count > 0 completes the timeout after count other completions as well
+  tl::expected<void, std::error_code> prep_timeout(__kernel_timespec *ts,
+                                                   unsigned count,
+                                                   unsigned flags,
+                                                   userData *usr) {
+    std::scoped_lock<decltype(uringAddMutex)> lock(uringAddMutex);
+    io_uring_sqe *sqe = io_uring_get_sqe(&uring);
+    if (sqe == nullptr) {
+      return tl::unexpected(make_error_code(uringErr::sqeBusy));
+    }
+    setData(sqe, usr);
+
+    io_uring_prep_timeout(sqe, ts, count, flags);
+
+    io_uring_submit(&uring);
+
+    return {};
+  }
+
+  // post a message to another ring, the target ring will get a cqe with
+  // res = value and user_data = target
+  // the completion of the post itself is reported to usr on this ring
+  tl::expected<void, std::error_code> prep_msg_ring(int targetRingFd,
+                                                    unsigned value,
+                                                    userData *target,
+                                                    userData *usr) {
+    std::scoped_lock<decltype(uringAddMutex)> lock(uringAddMutex);
+    io_uring_sqe *sqe = io_uring_get_sqe(&uring);
+    if (sqe == nullptr) {
+      return tl::unexpected(make_error_code(uringErr::sqeBusy));
+    }
+    setData(sqe, usr);
+
+    io_uring_prep_msg_ring(sqe, targetRingFd, value,
+                           reinterpret_cast<__u64>(target), 0);
+
+    io_uring_submit(&uring);
+
+    return {};
+  }
+
+  int fd() const noexcept { return uringFd; }
+
   // a userData struct should be created by the awaiter
   // and its pointer should be passed to the uring
 private:
+  // remember the submitting worker, the completion goes back to it
+  void setData(io_uring_sqe *sqe, userData *usr) {
+    usr->worker = pool.currentWorker();
+    io_uring_sqe_set_data(sqe, usr);
+  }
+
+  template <typename... Dispatchers>
+  static std::coroutine_handle<> invokeHandler(userData &caller, int res) {
+    std::coroutine_handle<> coro = nullptr;
+    bool known = ((caller.handlerType == &dispatchTag<Dispatchers> &&
+                   (coro = Dispatchers::invokeHandler(caller.handlerContext,
+                                                      res),
+                    true)) ||
+                  ...);
+    if (!known) {
+      coro = caller.multishotHandler(caller.handlerContext, res);
+    }
+    return coro;
+  }
+
+  void complete(std::coroutine_handle<> coro, std::size_t worker,
+                std::size_t &inlineLeft) {
+    if (policy == completionPolicy::inlineFirst && inlineLeft > 0) {
+      inlineLeft--;
+      resumedInline.fetch_add(1, std::memory_order::relaxed);
+      // runs until its next suspension point, which queues or submits it
+      coro.resume();
+      return;
+    }
+
+    resumedQueued.fetch_add(1, std::memory_order::relaxed);
+    if (policy == completionPolicy::queued || worker >= pool.size()) {
+      pool.addTask(coro);
+    } else {
+      pool.addTaskTo(worker, coro);
+    }
+  }
+
+  completionPolicy policy = completionPolicy::inlineFirst;
+  std::size_t inlineBudget = 16;
+  std::atomic<std::size_t> resumedInline = 0;
+  std::atomic<std::size_t> resumedQueued = 0;
+  // worker of the next multishot task, cqes of a ring are reaped by one
+  // coroutine so it needs no lock
+  std::size_t nextWorker = 0;
   std::mutex uringAddMutex;
   threadPool &pool;
   io_uring uring;
   int uringFd;
 };
 
+// cancels an in-flight request when the cancel source of the awaiting
+// coroutine fires, the request then completes with ECANCELED as usual
+struct uringCancelHook : cancelCallback {
+  // submit the request with prep, registered on the source if there is one
+  template <typename F>
+  tl::expected<void, std::error_code>
+  submit(cancelSource *cancelSrc, uringInstance &ring,
+         uringInstance::userData *request, F &&prep) {
+    if (cancelSrc == nullptr) {
+      return prep();
+    }
+
+    source = cancelSrc;
+    uring = &ring;
+    target = request;
+    invoke = &cancelRequest;
+
+    tl::expected<void, std::error_code> prepRes;
+    if (!cancelSrc->attach(*this, [&] {
+          prepRes = prep();
+          return prepRes.has_value();
+        })) {
+      return tl::unexpected(
+          std::make_error_code(std::errc::operation_canceled));
+    }
+    return prepRes;
+  }
+
+  // call in await_resume, before the awaiter goes away
+  void disarm() {
+    if (source != nullptr) {
+      source->detach(*this);
+    }
+  }
+
+  static void cancelRequest(cancelCallback &callback) {
+    auto &self = static_cast<uringCancelHook &>(callback);
+    // without a free sqe the request just runs to its end
+    if (!self.uring->prep_cancel(self.target)) {
+      debug("Failed to submit a cancel");
+    }
+  }
+
+  cancelSource *source = nullptr;
+  uringInstance *uring = nullptr;
+  uringInstance::userData *target = nullptr;
+};
+
 } // namespace ACPAcoro
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "async/Cancel.hpp"
+#include "async/Loop.hpp"
+
+#include <coroutine>
+#include <mutex>
+#include <system_error>
+
+namespace ACPAcoro {
+
+// a coroutine parked on a synchronization primitive
+struct waiterNode : cancelCallback {
+  waiterNode *prev = nullptr;
+  waiterNode *next = nullptr;
+  bool queued = false;
+  std::coroutine_handle<> coro = nullptr;
+  std::error_code error{};
+};
+
+// FIFO of parked awaiters, the nodes live in the awaiters
+struct waiterList {
+  bool empty() const noexcept { return head == nullptr; }
+
+  void push(waiterNode &node) {
+    node.prev = tail;
+    node.next = nullptr;
+    if (tail != nullptr) {
+      tail->next = &node;
+    } else {
+      head = &node;
+    }
+    tail = &node;
+    node.queued = true;
+  }
+
+  waiterNode &pop() {
+    auto &node = *head;
+    erase(node);
+    return node;
+  }
+
+  void erase(waiterNode &node) {
+    (node.prev != nullptr ? node.prev->next : head) = node.next;
+    (node.next != nullptr ? node.next->prev : tail) = node.prev;
+    node.prev = nullptr;
+    node.next = nullptr;
+    node.queued = false;
+  }
+
+  waiterNode *head = nullptr;
+  waiterNode *tail = nullptr;
+};
+
+// awaiter parking on a primitive whose state is guarded by owner.mutex,
+// parked coroutines are resumed on owner.pool
+//
+// Derived provides
+//   bool tryOrPark(): lock owner.mutex, then complete at once and return
+//                     false, or push itself to a list and return true
+//   waiterList &list(): the list it's parked on
+//
+// a parked awaiter is woken with ECANCELED if its coroutine is cancelled
+template <typename Derived, typename Owner>
+struct parkingAwaiter : waiterNode {
+  bool await_ready() const noexcept { return false; }
+
+  // parking happens under the lock of the cancel source,
+  // so a cancel can't be missed
+  template <typename P> bool await_suspend(std::coroutine_handle<P> coro) {
+    this->coro = coro;
+    auto &self = static_cast<Derived &>(*this);
+
+    cancel = cancelSourceOf(coro);
+    if (cancel == nullptr) {
+      return self.tryOrPark();
+    }
+
+    this->invoke = &cancelWait;
+    bool parked = false;
+    if (!cancel->attach(*this, [&] { return parked = self.tryOrPark(); })) {
+      this->error = std::make_error_code(std::errc::operation_canceled);
+      return false;
+    }
+    return parked;
+  }
+
+  static void cancelWait(cancelCallback &callback) {
+    auto &self = static_cast<Derived &>(callback);
+    auto &owner = self.owner;
+    {
+      std::scoped_lock<decltype(owner.mutex)> lock(owner.mutex);
+      if (!self.queued) {
+        return;
+      }
+      self.list().erase(self);
+      self.error = std::make_error_code(std::errc::operation_canceled);
+    }
+    owner.pool.addTask(self.coro);
+  }
+
+  // call in await_resume
+  void detachCancel() {
+    if (cancel != nullptr) {
+      cancel->detach(*this);
+    }
+  }
+
+  explicit parkingAwaiter(Owner &owner) : owner(owner) {}
+
+  Owner &owner;
+  cancelSource *cancel = nullptr;
+};
+
+} // namespace ACPAcoro
@@ -1,149 +1,270 @@
-/*
-uncompleted
-*/
-
 #pragma once
 
-// #include "async/Loop.hpp"
-// #include "async/Tasks.hpp"
-// #include "async/Traits.hpp"
-
-// #include <any>
-// #include <coroutine>
-// #include <cstddef>
-// #include <span>
-// #include <type_traits>
-// #include <vector>
-#include "Traits.hpp"
+#include "async/Cancel.hpp"
+#include "async/Context.hpp"
 #include "async/Loop.hpp"
 #include "async/Tasks.hpp"
+#include "async/Traits.hpp"
+#include "utils/ErrorHandle.hpp"
 
+#include <array>
+#include <atomic>
 #include <coroutine>
 #include <cstddef>
-#include <print>
+#include <exception>
+#include <new>
+#include <optional>
 #include <span>
 #include <tuple>
+#include <type_traits>
 #include <utility>
+#include <vector>
 
 namespace ACPAcoro {
 
+// one allocation for the frames of count coroutines of the same type,
+// released as a whole when the arena is destroyed
+struct frameArena {
+  explicit frameArena(std::size_t count) : count(count) {}
+  ~frameArena() { ::operator delete(buffer); }
+
+  frameArena(frameArena const &) = delete;
+  frameArena &operator=(frameArena const &) = delete;
+
+  // the buffer is allocated on the first call, when the frame size is known
+  void *allocate(std::size_t size) {
+    constexpr auto align = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+    size = (size + align - 1) & ~(align - 1);
+    if (buffer == nullptr) {
+      frameSize = size;
+      buffer = static_cast<std::byte *>(::operator new(frameSize * count));
+    }
+    if (size > frameSize || used == count) {
+      throwException(std::bad_alloc());
+    }
+    return buffer + frameSize * used++;
+  }
+
+  std::size_t count;
+  std::size_t used = 0;
+  std::size_t frameSize = 0;
+  std::byte *buffer = nullptr;
+};
+
+// shared by the children of a whenAll
 struct whenAllCtlBlock {
-  std::size_t count                  = 0;
+  explicit whenAllCtlBlock(std::size_t children) : count(children) {}
+
+  // return true for the last child
+  bool arrive() noexcept {
+    return count.fetch_sub(1, std::memory_order::acq_rel) == 1;
+  }
+
+  // keep the first exception
+  void setException(std::exception_ptr e) noexcept {
+    if (!failed.test_and_set(std::memory_order::relaxed)) {
+      exception = std::move(e);
+    }
+  }
+
+  void rethrowIfFailed() const {
+    if (exception) {
+      std::rethrow_exception(exception);
+    }
+  }
+
+  std::atomic<std::size_t> count;
   std::coroutine_handle<> callerCoro = nullptr;
+  std::atomic_flag failed = ATOMIC_FLAG_INIT;
+  std::exception_ptr exception = nullptr;
+
+  // where the helper frames of a range whenAll are allocated
+  frameArena *arena = nullptr;
+
+  // passed to the children
+  cancelSource *cancel = nullptr;
+  taskContext const *context = nullptr;
 };
 
-struct whenAllAwaiter {
-  auto await_ready() const noexcept -> bool { return false; }
-  auto await_suspend(std::coroutine_handle<> callerCoro) const noexcept {
-    loopInstance &loop = loopInstance::getInstance();
-    for (auto coro : taskCoros) {
-      loop.addTask(coro);
+// promise of the helper coroutine awaiting a child
+// the helper finishing last resumes the caller by symmetric transfer,
+// the others stop at the final suspend point. the frames are owned by the
+// helper tasks of the caller, so they are freed even if a child threw
+struct whenAllPromiseBase : cancellablePromise, contextPromise {
+  struct finalAwaiter {
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<>) const noexcept {
+      if (ctlBlock.arrive()) {
+        return ctlBlock.callerCoro;
+      }
+      return std::noop_coroutine();
     }
-    loop.runAll();
-    return callerCoro;
+    void await_resume() const noexcept {}
+
+    whenAllCtlBlock &ctlBlock;
+  };
+
+  template <typename... Args>
+  whenAllPromiseBase(whenAllCtlBlock &ctl, Args &&...) : ctlBlock(ctl) {
+    cancel = ctl.cancel;
+    context = ctl.context;
   }
 
-  void await_resume() const noexcept {}
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  finalAwaiter final_suspend() noexcept { return {ctlBlock}; }
+  void return_void() noexcept {}
+  void unhandled_exception() noexcept {
+    ctlBlock.setException(std::current_exception());
+  }
 
-  std::span<std::coroutine_handle<>> taskCoros;
+  whenAllCtlBlock &ctlBlock;
 };
 
-template <Awaitable A>
-Task<void, retPrevPromiseType>
-whenAllHelper(A &&task,
-              whenAllCtlBlock &ctlBlock,
-              typename AwaitableTraits<A>::nonVoidRetType &retVal) {
-  // std::println("non-void task");
-  retVal = co_await task;
-  if (--ctlBlock.count == 0) {
-    co_return ctlBlock.callerCoro;
+struct whenAllPromise : whenAllPromiseBase {
+  using whenAllPromiseBase::whenAllPromiseBase;
+
+  Task<void, whenAllPromise> get_return_object() noexcept {
+    return {std::coroutine_handle<whenAllPromise>::from_promise(*this)};
   }
-  co_return std::noop_coroutine();
-}
+};
+
+// helper frames allocated in the arena of the control block
+struct whenAllPooledPromise : whenAllPromiseBase {
+  using whenAllPromiseBase::whenAllPromiseBase;
+
+  Task<void, whenAllPooledPromise> get_return_object() noexcept {
+    return {std::coroutine_handle<whenAllPooledPromise>::from_promise(*this)};
+  }
+
+  template <typename... Args>
+  static void *operator new(std::size_t size, whenAllCtlBlock &ctl,
+                            Args &&...) {
+    return ctl.arena->allocate(size);
+  }
+
+  // freed with the arena
+  static void operator delete(void *, std::size_t) noexcept {}
+};
 
-template <Awaitable A>
-Task<void, retPrevPromiseType>
-whenAllHelper(A &&task, whenAllCtlBlock &ctlBlock, nonVoidHelper<void>) {
-  // std::println("void task");
-  co_await task;
-  if (--ctlBlock.count == 0) {
-    co_return ctlBlock.callerCoro;
+template <typename P, typename A, typename R>
+Task<void, P> whenAllHelper(whenAllCtlBlock &, A &&task, R &result) {
+  if constexpr (std::is_void_v<typename AwaitableTraits<A>::retType>) {
+    co_await std::forward<A>(task);
+  } else {
+    result = co_await std::forward<A>(task);
   }
-  co_return std::noop_coroutine();
 }
 
+// construct the result in its slot, R needs no default constructor
+template <typename P, typename A, typename R>
+Task<void, P> whenAllHelper(whenAllCtlBlock &, A &&task,
+                            std::optional<R> &slot) {
+  slot.emplace(co_await std::forward<A>(task));
+}
+
+// run the children on the thread pool
+// all but one are queued, the last one runs inline on this thread,
+// so the caller is suspended and can't be resumed before they are all queued
+struct whenAllAwaiter {
+  bool await_ready() const noexcept { return children.empty(); }
+
+  std::coroutine_handle<>
+  await_suspend(std::coroutine_handle<> callerCoro) const noexcept {
+    ctlBlock.callerCoro = callerCoro;
+    for (auto coro : children.first(children.size() - 1)) {
+      pool.addTask(coro);
+    }
+    return children.back();
+  }
+
+  void await_resume() const { ctlBlock.rethrowIfFailed(); }
+
+  whenAllCtlBlock &ctlBlock;
+  std::span<std::coroutine_handle<>> children;
+  threadPool &pool;
+};
+
 template <std::size_t... Is, typename... Ts>
 Task<std::tuple<typename AwaitableTraits<Ts>::nonVoidRetType...>>
 whenAllImpl(std::index_sequence<Is...>, Ts &&...tasks) {
   auto result = std::tuple<typename AwaitableTraits<Ts>::nonVoidRetType...>();
 
-  whenAllCtlBlock ctlBlock{sizeof...(Ts), co_await getSelfAwaiter{}};
+  whenAllCtlBlock ctlBlock{sizeof...(Ts)};
+  ctlBlock.cancel = co_await currentCancel{};
+  ctlBlock.context = co_await currentContext{};
 
-  std::array<std::coroutine_handle<>, sizeof...(Ts)> taskCoros = {
-      whenAllHelper(std::forward<Ts>(tasks), ctlBlock, std::get<Is>(result))
-          .detach()...};
+  std::array<Task<void, whenAllPromise>, sizeof...(Ts)> helpers = {
+      whenAllHelper<whenAllPromise>(ctlBlock, std::forward<Ts>(tasks),
+                                    std::get<Is>(result))...};
+  std::array<std::coroutine_handle<>, sizeof...(Ts)> children = {
+      helpers[Is].selfCoro...};
 
-  co_await whenAllAwaiter{taskCoros};
+  co_await whenAllAwaiter{ctlBlock, children, threadPool::current()};
 
-  co_return result;
+  co_return std::move(result);
 }
 
-template <Awaitable... Ts>
-auto whenAll(Ts &&...tasks) {
+// await all the tasks in parallel on the thread pool
+// return a tuple of the results, void results are nonVoidHelper<void>.
+// the first exception of the children is rethrown after all of them end
+template <Awaitable... Ts> auto whenAll(Ts &&...tasks) {
   return whenAllImpl(std::make_index_sequence<sizeof...(Ts)>(),
                      std::forward<Ts>(tasks)...);
 }
 
-// class whenAllCtlBlock {
-// public:
-//   std::size_t count                  = 0;
-//   std::coroutine_handle<> callerCoro = nullptr;
-// };
-
-// class whenAllAwaiter {
-// public:
-//   whenAllAwaiter(std::span<std::coroutine_handle<>> tasks,
-//                  std::vector<std::any> &results,
-//                  whenAllCtlBlock &ctl)
-//       : taskCoros(tasks), taskResults(results), ctlBlock(ctl) {}
-//   bool await_ready() const noexcept { return false; }
-
-//   auto await_suspend(std::coroutine_handle<>) const noexcept -> bool {
-//     loopInstance &loop = loopInstance::getInstance();
-//     for (auto coro : taskCoros) {
-//       loop.addTask(coro);
-//     }
-//     loop.runAll();
-//     return false;
-//   }
-
-//   void await_resume() const noexcept {}
-
-//   std::span<std::coroutine_handle<>> taskCoros;
-//   std::vector<std::any> &taskResults;
-//   whenAllCtlBlock &ctlBlock;
-// };
-
-// retPrevTask whenAllHelper(std::coroutine_handle<> calleeCoro,
-//                           whenAllCtlBlock &ctlBlock);
-
-// template <Awaitable... Ts>
-//   requires(sizeof...(Ts) > 1)
-// Task<std::vector<std::any>> whenAll(Ts... tasks) {
-
-//   whenAllCtlBlock ctlBlock;
+// await a runtime sized set of tasks in parallel on the thread pool
+// return the results in the order of the tasks.
+// the helper frames share one allocation, so the cost of the fan-out doesn't
+// grow with allocations per child. each result is constructed in its own
+// slot as its task ends, T needs no default constructor, then the results
+// are moved to the returned vector
+template <typename T>
+Task<std::conditional_t<std::is_void_v<T>, void, std::vector<T>>>
+whenAll(std::span<Task<T>> tasks) {
+  using resultType = typename nonVoidHelper<T>::type;
+  std::vector<std::optional<resultType>> slots;
+  nonVoidHelper<void>::type unused;
+  if constexpr (!std::is_void_v<T>) {
+    slots.resize(tasks.size());
+  }
 
-//   ctlBlock.count      = sizeof...(Ts);
+  frameArena arena(tasks.size());
+  whenAllCtlBlock ctlBlock{tasks.size()};
+  ctlBlock.arena = &arena;
+  ctlBlock.cancel = co_await currentCancel{};
+  ctlBlock.context = co_await currentContext{};
 
-//   ctlBlock.callerCoro = co_await getSelfAwaiter{};
+  // destroyed before the arena
+  std::vector<Task<void, whenAllPooledPromise>> helpers;
+  std::vector<std::coroutine_handle<>> children;
+  helpers.reserve(tasks.size());
+  children.reserve(tasks.size());
+  for (std::size_t i = 0; i < tasks.size(); i++) {
+    if constexpr (std::is_void_v<T>) {
+      helpers.push_back(
+          whenAllHelper<whenAllPooledPromise>(ctlBlock, tasks[i], unused));
+    } else {
+      helpers.push_back(
+          whenAllHelper<whenAllPooledPromise>(ctlBlock, tasks[i], slots[i]));
+    }
+    children.push_back(helpers.back().selfCoro);
+  }
 
-//   std::vector<std::any> taskResults;
-//   std::array<std::coroutine_handle<>, sizeof...(Ts)> taskCoros = {
-//       whenAllHelper(tasks.selfCoro, ctlBlock).detach()...};
+  co_await whenAllAwaiter{ctlBlock, children, threadPool::current()};
 
-//   co_await whenAllAwaiter{taskCoros, ctlBlock};
+  if constexpr (!std::is_void_v<T>) {
+    std::vector<T> results;
+    results.reserve(slots.size());
+    for (auto &slot : slots) {
+      results.push_back(std::move(*slot));
+    }
+    co_return std::move(results);
+  }
+}
 
-//   co_return;
-// }
+template <typename T> auto whenAll(std::vector<Task<T>> &tasks) {
+  return whenAll(std::span<Task<T>>(tasks));
+}
 
-} // namespace ACPAcoro
\ No newline at end of file
+} // namespace ACPAcoro
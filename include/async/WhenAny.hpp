@@ -0,0 +1,112 @@
+#pragma once
+
+#include "async/Cancel.hpp"
+#include "async/Loop.hpp"
+#include "async/Tasks.hpp"
+#include "async/Traits.hpp"
+#include "async/WhenAll.hpp"
+
+#include <array>
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+namespace ACPAcoro {
+
+// the first child to end wins, the others are cancelled through the
+// cancel source shared by the children
+struct whenAnyCtlBlock : whenAllCtlBlock {
+  explicit whenAnyCtlBlock(std::size_t children) : whenAllCtlBlock(children) {
+    whenAllCtlBlock::cancel = &source;
+  }
+
+  // return true for the first child to end
+  bool claim() {
+    if (won.test_and_set(std::memory_order::acq_rel)) {
+      return false;
+    }
+    source.requestCancel();
+    return true;
+  }
+
+  cancelSource source;
+  std::atomic_flag won = ATOMIC_FLAG_INIT;
+};
+
+// the exception of a child counts as its result if it's the first to end
+struct whenAnyPromise : whenAllPromiseBase {
+  using whenAllPromiseBase::whenAllPromiseBase;
+
+  Task<void, whenAnyPromise> get_return_object() noexcept {
+    return {std::coroutine_handle<whenAnyPromise>::from_promise(*this)};
+  }
+
+  void unhandled_exception() noexcept {
+    if (static_cast<whenAnyCtlBlock &>(ctlBlock).claim()) {
+      ctlBlock.setException(std::current_exception());
+    }
+  }
+};
+
+// losers end with whatever the cancel makes of them, e.g. ECANCELED,
+// their results and exceptions are dropped
+template <std::size_t I, typename A, typename V>
+Task<void, whenAnyPromise> whenAnyHelper(whenAnyCtlBlock &ctlBlock, A &&task,
+                                         V &result) {
+  if constexpr (std::is_void_v<typename AwaitableTraits<A>::retType>) {
+    co_await std::forward<A>(task);
+    if (ctlBlock.claim()) {
+      result.template emplace<I>();
+    }
+  } else {
+    auto value = co_await std::forward<A>(task);
+    if (ctlBlock.claim()) {
+      result.template emplace<I>(std::move(value));
+    }
+  }
+}
+
+template <std::size_t... Is, typename... Ts>
+Task<std::variant<typename AwaitableTraits<Ts>::nonVoidRetType...>>
+whenAnyImpl(std::index_sequence<Is...>, Ts &&...tasks) {
+  auto result =
+      std::variant<typename AwaitableTraits<Ts>::nonVoidRetType...>();
+
+  whenAnyCtlBlock ctlBlock{sizeof...(Ts)};
+  forwardCancel callerCancel(co_await currentCancel{}, ctlBlock.source);
+  ctlBlock.context = co_await currentContext{};
+
+  std::array<Task<void, whenAnyPromise>, sizeof...(Ts)> helpers = {
+      whenAnyHelper<Is>(ctlBlock, std::forward<Ts>(tasks), result)...};
+  std::array<std::coroutine_handle<>, sizeof...(Ts)> children = {
+      helpers[Is].selfCoro...};
+
+  co_await whenAllAwaiter{ctlBlock, children, threadPool::current()};
+
+  co_return std::move(result);
+}
+
+// race the tasks on the thread pool
+// return the result of the first one to end, its index is result.index().
+// the others are cancelled, their in-flight io_uring requests and timers
+// included, and awaited before returning, so no frame outlives the call.
+// the exception of the winner is rethrown
+//
+// a loser ends only once it reaches a cancellable suspension point: the
+// io_uring awaiters, timers, readable() / writable() of the epoll sockets
+// and the parking awaiters of Sync.hpp and Channel.hpp, awaited from Task
+// coroutines which carry the cancel source. a loser looping on the CPU or
+// waiting on anything else keeps the call waiting, it has to check
+// co_await currentCancel{} by itself
+template <Awaitable... Ts>
+  requires(sizeof...(Ts) > 0)
+auto whenAny(Ts &&...tasks) {
+  return whenAnyImpl(std::make_index_sequence<sizeof...(Ts)>(),
+                     std::forward<Ts>(tasks)...);
+}
+
+} // namespace ACPAcoro
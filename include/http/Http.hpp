@@ -1,13 +1,18 @@
 #pragma once
 
+#include "http/HttpParser.hpp"
 #include "http/Socket.hpp"
 #include "tl/expected.hpp"
 
+#include <array>
+#include <cstddef>
 #include <filesystem>
+#include <forward_list>
 #include <map>
 #include <memory>
 #include <oneapi/tbb/concurrent_hash_map.h>
 #include <optional>
+#include <span>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -29,11 +34,30 @@ enum class httpErrc {
   UNCOMPLETED_REQUEST = 600,
 };
 
+// header fields as views, the ones of a request point into its buffer
+//
+// the first inlineCapacity fields are stored in place, so the headers of
+// a typical request are parsed without allocating. names are compared
+// case-insensitively and the first field of a name wins.
+// addOwned() keeps a copy of the value, for the fields built by a response
 class httpHeaders {
 public:
+  struct field {
+    std::string_view name;
+    std::string_view value;
+  };
+
+  static constexpr std::size_t inlineCapacity = 16;
+
   httpHeaders() = default;
   ~httpHeaders() = default;
 
+  // a move keeps the owned values in place, a copy couldn't
+  httpHeaders(httpHeaders &&) = default;
+  httpHeaders &operator=(httpHeaders &&) = default;
+  httpHeaders(httpHeaders const &) = delete;
+  httpHeaders &operator=(httpHeaders const &) = delete;
+
   static inline std::unordered_set<std::string_view> const validRequestHeaders =
       {
           "Accept",     "Accept-Encoding",  "Connection",   "Host",
@@ -43,7 +67,72 @@ public:
   static bool checkHeader(std::string_view header) {
     return validRequestHeaders.contains(header);
   };
-  std::map<std::string, std::string> data{};
+
+  static bool equalsIgnoreCase(std::string_view a,
+                               std::string_view b) noexcept {
+    if (a.size() != b.size()) {
+      return false;
+    }
+    for (std::size_t i = 0; i < a.size(); i++) {
+      if (toLower(a[i]) != toLower(b[i])) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // the views must outlive the table
+  void add(std::string_view name, std::string_view value) {
+    if (count < inlineCapacity) {
+      inlineFields[count] = {name, value};
+    } else {
+      if (count == inlineCapacity) {
+        spilled.assign(inlineFields.begin(), inlineFields.end());
+      }
+      spilled.push_back({name, value});
+    }
+    count++;
+  }
+
+  // the name must outlive the table, e.g. a literal
+  void addOwned(std::string_view name, std::string value) {
+    add(name, owned.emplace_front(std::move(value)));
+  }
+
+  // the value of the first field with the name
+  std::optional<std::string_view> get(std::string_view name) const noexcept {
+    for (auto const &field : fields()) {
+      if (equalsIgnoreCase(field.name, name)) {
+        return field.value;
+      }
+    }
+    return std::nullopt;
+  }
+
+  bool contains(std::string_view name) const noexcept {
+    return get(name).has_value();
+  }
+
+  std::span<field const> fields() const noexcept {
+    if (count <= inlineCapacity) {
+      return {inlineFields.data(), count};
+    }
+    return spilled;
+  }
+
+  std::size_t size() const noexcept { return count; }
+
+private:
+  static char toLower(char c) noexcept {
+    return c >= 'A' && c <= 'Z' ? static_cast<char>(c | 0x20) : c;
+  }
+
+  std::array<field, inlineCapacity> inlineFields;
+  std::size_t count = 0;
+  // all the fields once there are more than inlineCapacity
+  std::vector<field> spilled;
+  // a node never moves, the views of its value stay valid
+  std::forward_list<std::string> owned;
 };
 
 class chunkedBody {
@@ -58,6 +147,11 @@ public:
   httpMessage() = default;
   virtual ~httpMessage() = default;
 
+  httpMessage(httpMessage &&) = default;
+  httpMessage &operator=(httpMessage &&) = default;
+  httpMessage(httpMessage const &) = delete;
+  httpMessage &operator=(httpMessage const &) = delete;
+
   using statusCode = httpErrc;
 
   enum class method {
@@ -82,29 +176,47 @@ public:
   httpRequest() = default;
   ~httpRequest() = default;
 
+  // the request keeps the buffer, its headers are views of it
+  tl::expected<void, std::error_code>
+      parseResquest(std::shared_ptr<std::string const>);
+  // split a head framed by the parser with the bounds it recorded,
+  // the head isn't scanned again
   tl::expected<void, std::error_code>
-      parseResquest(std::unique_ptr<std::string>);
+  parseResquest(std::shared_ptr<std::string const>, requestParser const &);
   tl::expected<void, std::error_code> parseHeaders(std::string_view &);
   tl::expected<void, std::error_code> parseFirstLine(std::string_view &);
 
   /**   @brief Read the request message from the socket
-   *    @return A shared_ptr to the string that contains the request message
+   *    @return A shared_ptr to the string that contains the request head,
+   *            the bytes read past it are kept for the next call.
+   *            the head is split into this request as it's completed,
+   *            a bad request line or field is left in status
    *    @retval
    *    1) socketError::eofError: when the read encounter a eof
    *
    *    2) httpError::uncompletedRequest: when the read encounter a EWOULDBLOCK
-   *       or EAGAIN and the request is not completed (end with "\r\n\r\n")
+   *       or EAGAIN and the request head is not completed
+   *
+   *    3) httpError::badRequest: when the head is malformed or too long
    *
-   *    3) other errors: when the read encounter other error from the read
+   *    4) other errors: when the read encounter other error from the read
    *       operation except EWOULDBLOCK or EAGAIN
    */
-  static tl::expected<std::shared_ptr<std::string>, std::error_code>
+  tl::expected<std::shared_ptr<std::string>, std::error_code>
   readRequest(reactorSocket &);
 
   static bool checkMethod(std::string_view method);
   static bool checkVersion(std::string_view version);
-  static std::shared_ptr<std::string> getBuffer(int fd);
-  static void eraseBuffer(int fd);
+
+  // the head being read on a connection, from the bytes left over by
+  // the previous one
+  struct pendingRequest {
+    std::shared_ptr<std::string> buffer = std::make_shared<std::string>();
+    requestParser parser;
+  };
+
+  static std::shared_ptr<pendingRequest> getPending(int fd);
+  static void erasePending(int fd);
 
   httpRequest(httpRequest &&) = default;
   httpRequest &operator=(httpRequest &&) = default;
@@ -113,9 +225,17 @@ public:
 
   std::filesystem::path uri{};
   bool completed = false;
+  // the head the header fields point into
+  std::shared_ptr<std::string const> buffer;
 
-  static tbb::concurrent_hash_map<int, std::shared_ptr<std::string>>
+  static tbb::concurrent_hash_map<int, std::shared_ptr<pendingRequest>>
       uncompletedRequests;
+
+private:
+  tl::expected<void, std::error_code>
+  setFirstLine(std::string_view, httpScan::requestLine const &);
+  // "Connection: close" ends the session with an eofError
+  tl::expected<void, std::error_code> checkConnection();
 };
 
 class httpResponse : public httpMessage {
@@ -123,6 +243,11 @@ public:
   httpResponse() = default;
   ~httpResponse() = default;
 
+  httpResponse(httpResponse &&) = default;
+  httpResponse &operator=(httpResponse &&) = default;
+  httpResponse(httpResponse const &) = delete;
+  httpResponse &operator=(httpResponse const &) = delete;
+
   // inline static std::unordered_set<std::string_view> const MIMEtypes{
   //     "text/html",       "text/plain",
   //     "image/jpeg",      "image/png",
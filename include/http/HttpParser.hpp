@@ -0,0 +1,244 @@
+#pragma once
+
+#include "http/HttpScan.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+
+namespace ACPAcoro {
+
+// a resumable parser of a request head, fed with the bytes of a
+// connection as they are read
+//
+//   requestParser parser;
+//   buffer.append(chunk);
+//   auto [status, leftover] = parser.feed(chunk);
+//   if (status == httpScan::headStatus::complete) {
+//     // buffer[0, parser.headSize()) is the head,
+//     // the last leftover bytes begin the next request
+//   }
+//
+// every byte is looked at once, whatever the reads split the head into:
+// the state between two chunks is where the parser stopped, not the
+// bytes. runs of a target, a version, a header name or a field value are
+// skipped with the SIMD matchers of httpScan. the grammar is checked as it
+// arrives, a malformed head fails at its first wrong byte rather than at
+// its end. the bounds of the request line and of the fields are recorded
+// on the way, httpRequest::parseResquest(head, parser) splits the complete
+// head with them and only looks again at the whitespace around the values
+class requestParser {
+public:
+  struct result {
+    httpScan::headStatus status;
+    // bytes of the chunk following the head, once it's complete
+    std::size_t leftover;
+  };
+
+  static constexpr std::size_t defaultMaxHeadSize = 4096;
+
+  explicit requestParser(
+      std::size_t maxHeadSize = defaultMaxHeadSize) noexcept
+      : maxHeadSize(maxHeadSize) {}
+
+  // consume the bytes following the ones fed so far
+  // a complete or malformed head takes nothing more until reset()
+  result feed(std::string_view chunk) noexcept {
+    if (current != httpScan::headStatus::incomplete) {
+      return {current, current == httpScan::headStatus::complete
+                           ? chunk.size()
+                           : 0};
+    }
+
+    // the head can't grow past maxHeadSize
+    auto s = chunk.substr(0, maxHeadSize - headBytes);
+    auto pos = scan(s);
+    headBytes += pos;
+
+    if (current == httpScan::headStatus::complete) {
+      return {current, chunk.size() - pos};
+    }
+    if (current == httpScan::headStatus::incomplete &&
+        headBytes == maxHeadSize) {
+      current = httpScan::headStatus::malformed;
+    }
+    return {current, 0};
+  }
+
+  // ready for the head of the next request
+  // the recorded bounds are overwritten as the next head is fed
+  void reset() noexcept {
+    headBytes = 0;
+    runLength = 0;
+    fields = 0;
+    at = step::method;
+    current = httpScan::headStatus::incomplete;
+  }
+
+  httpScan::headStatus status() const noexcept { return current; }
+
+  // bytes of the head fed so far, its size once it's complete
+  std::size_t headSize() const noexcept { return headBytes; }
+
+  // the bounds of a complete head, offsets from its first byte
+  httpScan::requestLine const &requestLine() const noexcept { return line; }
+
+  // a value still holds the whitespace surrounding it
+  std::span<httpScan::headerLine const> headerLines() const noexcept {
+    return std::span(lines).first(fields);
+  }
+
+private:
+  enum class step : std::uint8_t {
+    method,
+    target,
+    version,
+    lineEnd,
+    fieldStart,
+    fieldName,
+    fieldValue,
+    headEnd,
+  };
+
+  // run the state machine over s, return the bytes it consumed
+  std::size_t scan(std::string_view s) noexcept {
+    std::size_t pos = 0;
+    auto size = s.size();
+
+    while (pos < size) {
+      std::size_t end;
+      switch (at) {
+      case step::method:
+        end = httpScan::firstNotIn(s, pos, size, httpScan::tokenChars);
+        if (!endRun(s, pos, end, ' ', step::target)) {
+          return pos;
+        }
+        break;
+
+      case step::target:
+        end = httpScan::findFirst(s, pos, httpScan::notTargetChar{});
+        if (!endRun(s, pos, end, ' ', step::version)) {
+          return pos;
+        }
+        break;
+
+      case step::version:
+        end = httpScan::findFirst(s, pos, httpScan::notFieldChar{});
+        if (!endRun(s, pos, end, '\r', step::lineEnd)) {
+          return pos;
+        }
+        break;
+
+      case step::lineEnd:
+        if (!expect(s[pos++], '\n', step::fieldStart)) {
+          return pos;
+        }
+        break;
+
+      case step::fieldStart:
+        if (s[pos] == '\r') {
+          pos++;
+          at = step::headEnd;
+        } else if (fields == httpScan::maxHeaders) {
+          current = httpScan::headStatus::malformed;
+          return pos;
+        } else {
+          lines[fields++].name.begin =
+              static_cast<std::uint32_t>(headBytes + pos);
+          at = step::fieldName;
+        }
+        break;
+
+      case step::fieldName:
+        end = httpScan::findFirst(s, pos, httpScan::notTokenChar{});
+        if (!endRun(s, pos, end, ':', step::fieldValue)) {
+          return pos;
+        }
+        break;
+
+      case step::fieldValue:
+        // a field value may be empty
+        runLength = 1;
+        end = httpScan::findFirst(s, pos, httpScan::notFieldChar{});
+        if (!endRun(s, pos, end, '\r', step::lineEnd)) {
+          return pos;
+        }
+        break;
+
+      case step::headEnd:
+        if (expect(s[pos++], '\n', step::headEnd)) {
+          current = httpScan::headStatus::complete;
+        }
+        return pos;
+      }
+    }
+    return pos;
+  }
+
+  // a run of the current step ends at end, with the delimiter if it's in s
+  // return false once the parse stops
+  bool endRun(std::string_view s, std::size_t &pos, std::size_t end,
+              char delimiter, step following) noexcept {
+    if (end == httpScan::npos || end == s.size()) {
+      runLength += s.size() - pos;
+      pos = s.size();
+      return true;
+    }
+    runLength += end - pos;
+    pos = end + 1;
+    if (runLength == 0) {
+      current = httpScan::headStatus::malformed;
+      return false;
+    }
+    runLength = 0;
+    record(static_cast<std::uint32_t>(headBytes + end));
+    return expect(s[end], delimiter, following);
+  }
+
+  // the run of the current step ends at the offset end of the head
+  void record(std::uint32_t end) noexcept {
+    switch (at) {
+    case step::method:
+      line.method = {0, end};
+      break;
+    case step::target:
+      line.target = {line.method.end + 1, end};
+      break;
+    case step::version:
+      line.version = {line.target.end + 1, end};
+      break;
+    case step::fieldName:
+      lines[fields - 1].name.end = end;
+      break;
+    case step::fieldValue:
+      lines[fields - 1].value = {lines[fields - 1].name.end + 1, end};
+      break;
+    default:
+      break;
+    }
+  }
+
+  bool expect(char c, char expected, step following) noexcept {
+    if (c != expected) {
+      current = httpScan::headStatus::malformed;
+      return false;
+    }
+    at = following;
+    return true;
+  }
+
+  std::size_t maxHeadSize;
+  std::size_t headBytes = 0;
+  // bounds of the head fed so far, left uninitialized like httpScan's
+  httpScan::requestLine line;
+  std::array<httpScan::headerLine, httpScan::maxHeaders> lines;
+  // bytes of the method, target, version or name read so far
+  std::uint32_t runLength = 0;
+  std::uint16_t fields = 0;
+  step at = step::method;
+  httpScan::headStatus current = httpScan::headStatus::incomplete;
+};
+
+} // namespace ACPAcoro
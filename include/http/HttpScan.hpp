@@ -0,0 +1,433 @@
+#pragma once
+
+// byte scanning of a request head
+//
+// the header lines are indexed in one pass over the head, 32 (AVX2) or 16
+// (SSE2) bytes at a time: every byte a field value can't hold is located,
+// the CRLFs end the lines and anything else is an error. the request
+// target is scanned the same way for its end, and the header names are
+// checked against the token table with SSSE3 shuffles.
+// the method, the tail of the buffer and the names without SSSE3 are
+// checked byte by byte with the lookup tables.
+// AVX2 and SSSE3 are enabled by building with ACPACORO_NATIVE_ARCH=ON
+//
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace ACPAcoro::httpScan {
+
+inline constexpr std::size_t npos = std::string_view::npos;
+
+using charTable = std::array<bool, 256>;
+
+// tchar of RFC 9110, the characters of a method or a header name
+inline constexpr charTable tokenChars = [] {
+  charTable table{};
+  for (int c = '0'; c <= '9'; c++) {
+    table[c] = true;
+  }
+  for (int c = 'A'; c <= 'Z'; c++) {
+    table[c] = true;
+  }
+  for (int c = 'a'; c <= 'z'; c++) {
+    table[c] = true;
+  }
+  for (unsigned char c : std::string_view("!#$%&'*+-.^_`|~")) {
+    table[c] = true;
+  }
+  return table;
+}();
+
+// visible ascii, the characters of a request target
+inline constexpr charTable targetChars = [] {
+  charTable table{};
+  for (int c = 0x21; c <= 0x7e; c++) {
+    table[c] = true;
+  }
+  return table;
+}();
+
+// field-vchar, space and tab, obs-text included
+inline constexpr charTable fieldChars = [] {
+  charTable table{};
+  table['\t'] = true;
+  for (int c = 0x20; c <= 0xff; c++) {
+    table[c] = c != 0x7f;
+  }
+  return table;
+}();
+
+// the matchers give the mask of the bytes they match in a block,
+// and whether they match a single byte for the tail
+
+// bytes outside of targetChars
+struct notTargetChar {
+#if defined(__AVX2__)
+  std::uint32_t operator()(__m256i block) const noexcept {
+    // as signed bytes, everything below 0x21 and from 0x80
+    auto low = _mm256_cmpgt_epi8(_mm256_set1_epi8(0x21), block);
+    auto del = _mm256_cmpeq_epi8(block, _mm256_set1_epi8(0x7f));
+    return _mm256_movemask_epi8(_mm256_or_si256(low, del));
+  }
+#endif
+#if defined(__SSE2__)
+  std::uint32_t operator()(__m128i block) const noexcept {
+    auto low = _mm_cmpgt_epi8(_mm_set1_epi8(0x21), block);
+    auto del = _mm_cmpeq_epi8(block, _mm_set1_epi8(0x7f));
+    return _mm_movemask_epi8(_mm_or_si128(low, del));
+  }
+#endif
+  bool operator()(char c) const noexcept {
+    return !targetChars[static_cast<unsigned char>(c)];
+  }
+};
+
+// bytes outside of fieldChars, CR and LF included
+struct notFieldChar {
+#if defined(__AVX2__)
+  std::uint32_t operator()(__m256i block) const noexcept {
+    // unsigned block <= 0x1f
+    auto control = _mm256_cmpeq_epi8(
+        _mm256_min_epu8(block, _mm256_set1_epi8(0x1f)), block);
+    auto tab = _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\t'));
+    auto del = _mm256_cmpeq_epi8(block, _mm256_set1_epi8(0x7f));
+    return _mm256_movemask_epi8(
+        _mm256_or_si256(_mm256_andnot_si256(tab, control), del));
+  }
+#endif
+#if defined(__SSE2__)
+  std::uint32_t operator()(__m128i block) const noexcept {
+    auto control =
+        _mm_cmpeq_epi8(_mm_min_epu8(block, _mm_set1_epi8(0x1f)), block);
+    auto tab = _mm_cmpeq_epi8(block, _mm_set1_epi8('\t'));
+    auto del = _mm_cmpeq_epi8(block, _mm_set1_epi8(0x7f));
+    return _mm_movemask_epi8(_mm_or_si128(_mm_andnot_si128(tab, control), del));
+  }
+#endif
+  bool operator()(char c) const noexcept {
+    return !fieldChars[static_cast<unsigned char>(c)];
+  }
+};
+
+// bytes outside of tokenChars
+// the table is looked up 16 bytes at a time with two shuffles: the low
+// nibble of a byte selects the rows of the table holding it, the high
+// nibble its row
+struct notTokenChar {
+  // the tokens are in the rows 0x2 to 0x7
+  static constexpr std::array<std::uint8_t, 16> rowsOfLow = [] {
+    std::array<std::uint8_t, 16> rows{};
+    for (int low = 0; low < 16; low++) {
+      for (int row = 2; row < 8; row++) {
+        if (tokenChars[row * 16 + low]) {
+          rows[low] |= 1 << (row - 2);
+        }
+      }
+    }
+    return rows;
+  }();
+
+  static constexpr std::array<std::uint8_t, 16> rowOfHigh = [] {
+    std::array<std::uint8_t, 16> rows{};
+    for (int row = 2; row < 8; row++) {
+      rows[row] = 1 << (row - 2);
+    }
+    return rows;
+  }();
+
+#if defined(__AVX2__)
+  std::uint32_t operator()(__m256i block) const noexcept {
+    auto lows = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<__m128i const *>(rowsOfLow.data())));
+    auto highs = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<__m128i const *>(rowOfHigh.data())));
+    auto nibble = _mm256_set1_epi8(0x0f);
+    auto low = _mm256_shuffle_epi8(lows, _mm256_and_si256(block, nibble));
+    auto high = _mm256_shuffle_epi8(
+        highs, _mm256_and_si256(_mm256_srli_epi16(block, 4), nibble));
+    auto miss = _mm256_cmpeq_epi8(_mm256_and_si256(low, high),
+                                  _mm256_setzero_si256());
+    return _mm256_movemask_epi8(miss);
+  }
+#endif
+#if defined(__SSSE3__)
+  std::uint32_t operator()(__m128i block) const noexcept {
+    auto lows =
+        _mm_loadu_si128(reinterpret_cast<__m128i const *>(rowsOfLow.data()));
+    auto highs =
+        _mm_loadu_si128(reinterpret_cast<__m128i const *>(rowOfHigh.data()));
+    auto nibble = _mm_set1_epi8(0x0f);
+    auto low = _mm_shuffle_epi8(lows, _mm_and_si128(block, nibble));
+    auto high = _mm_shuffle_epi8(
+        highs, _mm_and_si128(_mm_srli_epi16(block, 4), nibble));
+    auto miss =
+        _mm_cmpeq_epi8(_mm_and_si128(low, high), _mm_setzero_si128());
+    return _mm_movemask_epi8(miss);
+  }
+#endif
+  bool operator()(char c) const noexcept {
+    return !tokenChars[static_cast<unsigned char>(c)];
+  }
+};
+
+// position of the first byte from pos the matcher matches, npos if none
+template <typename M>
+std::size_t findFirst(std::string_view s, std::size_t pos,
+                      M const &match) noexcept {
+  auto data = s.data();
+  auto size = s.size();
+
+#if defined(__AVX2__)
+  for (; pos + 32 <= size; pos += 32) {
+    auto block =
+        _mm256_loadu_si256(reinterpret_cast<__m256i const *>(data + pos));
+    if (auto mask = match(block)) {
+      return pos + std::countr_zero(mask);
+    }
+  }
+#endif
+
+#if defined(__SSE2__)
+  // the matchers needing SSSE3 go byte by byte without it
+  if constexpr (requires(__m128i block) { match(block); }) {
+    for (; pos + 16 <= size; pos += 16) {
+      auto block =
+          _mm_loadu_si128(reinterpret_cast<__m128i const *>(data + pos));
+      if (auto mask = match(block)) {
+        return pos + std::countr_zero(mask);
+      }
+    }
+  }
+#endif
+
+  for (; pos < size; pos++) {
+    if (match(data[pos])) {
+      return pos;
+    }
+  }
+  return npos;
+}
+
+// position of the first character of [pos, end) missing from the table,
+// end if there is none
+inline std::size_t firstNotIn(std::string_view s, std::size_t pos,
+                              std::size_t end,
+                              charTable const &table) noexcept {
+  for (; pos < end; pos++) {
+    if (!table[static_cast<unsigned char>(s[pos])]) {
+      return pos;
+    }
+  }
+  return end;
+}
+
+// position of the CRLF ending the field value or the version from pos,
+// npos if there is none or a character it can't hold comes first
+inline std::size_t findLineEnd(std::string_view s, std::size_t pos) noexcept {
+  pos = findFirst(s, pos, notFieldChar{});
+  if (pos == npos || s[pos] != '\r' || pos + 1 >= s.size() ||
+      s[pos + 1] != '\n') {
+    return npos;
+  }
+  return pos;
+}
+
+// [begin, end) of the scanned buffer
+// left uninitialized, an index of unused lines costs nothing
+struct slice {
+  std::string_view of(std::string_view buffer) const noexcept {
+    return {buffer.data() + begin, buffer.data() + end};
+  }
+
+  std::uint32_t begin;
+  std::uint32_t end;
+};
+
+struct requestLine {
+  slice method;
+  slice target;
+  slice version;
+};
+
+struct headerLine {
+  slice name;
+  slice value;
+};
+
+// scan the request line at the start of s
+// return the position following its CRLF, npos if it's malformed
+inline std::size_t scanRequestLine(std::string_view s,
+                                   requestLine &line) noexcept {
+  auto methodEnd = firstNotIn(s, 0, s.size(), tokenChars);
+  if (methodEnd == 0 || methodEnd == s.size() || s[methodEnd] != ' ') {
+    return npos;
+  }
+
+  auto targetBegin = methodEnd + 1;
+  auto targetEnd = findFirst(s, targetBegin, notTargetChar{});
+  if (targetEnd == npos || targetEnd == targetBegin || s[targetEnd] != ' ') {
+    return npos;
+  }
+
+  auto versionBegin = targetEnd + 1;
+  auto lineEnd = findLineEnd(s, versionBegin);
+  if (lineEnd == npos || lineEnd == versionBegin) {
+    return npos;
+  }
+
+  line.method = {0, static_cast<std::uint32_t>(methodEnd)};
+  line.target = {static_cast<std::uint32_t>(targetBegin),
+                 static_cast<std::uint32_t>(targetEnd)};
+  line.version = {static_cast<std::uint32_t>(versionBegin),
+                  static_cast<std::uint32_t>(lineEnd)};
+  return lineEnd + 2;
+}
+
+inline constexpr std::size_t maxHeaders = 64;
+
+// the header lines of a head, without their CRLF
+struct headerIndex {
+  std::span<slice const> view() const noexcept {
+    return std::span(lines).first(count);
+  }
+
+  std::array<slice, maxHeaders> lines;
+  std::size_t count = 0;
+  // bytes of the head, the empty line included
+  std::size_t size = 0;
+};
+
+enum class headStatus {
+  complete,
+  incomplete,
+  malformed,
+};
+
+// index the header lines of s, up to the empty line ending the head
+// more than maxHeaders lines are malformed
+inline headStatus indexHeaders(std::string_view s,
+                               headerIndex &index) noexcept {
+  auto data = s.data();
+  auto size = s.size();
+  auto result = headStatus::incomplete;
+  std::size_t lineStart = 0;
+  // the LF of the last CRLF
+  std::size_t skip = npos;
+  index.count = 0;
+
+  // p holds a byte no field value can, return true to stop
+  auto visit = [&](std::size_t p) {
+    if (p == skip) {
+      return false;
+    }
+    if (data[p] != '\r') {
+      result = headStatus::malformed;
+      return true;
+    }
+    if (p + 1 == size) {
+      return true;
+    }
+    if (data[p + 1] != '\n') {
+      result = headStatus::malformed;
+      return true;
+    }
+    skip = p + 1;
+
+    if (p == lineStart) {
+      index.size = p + 2;
+      result = headStatus::complete;
+      return true;
+    }
+    if (index.count == maxHeaders) {
+      result = headStatus::malformed;
+      return true;
+    }
+    index.lines[index.count++] = {static_cast<std::uint32_t>(lineStart),
+                                  static_cast<std::uint32_t>(p)};
+    lineStart = p + 2;
+    return false;
+  };
+
+  std::size_t pos = 0;
+  notFieldChar match;
+
+#if defined(__AVX2__)
+  for (; pos + 32 <= size; pos += 32) {
+    auto block =
+        _mm256_loadu_si256(reinterpret_cast<__m256i const *>(data + pos));
+    std::uint32_t cr = _mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\r')));
+    std::uint32_t lf = _mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\n')));
+    // the LF of a CRLF within the block is checked with its CR
+    auto mask = match(block) & ~((cr << 1) & lf);
+    for (; mask != 0; mask &= mask - 1) {
+      if (visit(pos + std::countr_zero(mask))) {
+        return result;
+      }
+    }
+  }
+#endif
+
+#if defined(__SSE2__)
+  for (; pos + 16 <= size; pos += 16) {
+    auto block = _mm_loadu_si128(reinterpret_cast<__m128i const *>(data + pos));
+    std::uint32_t cr =
+        _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8('\r')));
+    std::uint32_t lf =
+        _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8('\n')));
+    auto mask = match(block) & ~((cr << 1) & lf);
+    for (; mask != 0; mask &= mask - 1) {
+      if (visit(pos + std::countr_zero(mask))) {
+        return result;
+      }
+    }
+  }
+#endif
+
+  for (; pos < size; pos++) {
+    if (match(data[pos]) && visit(pos)) {
+      return result;
+    }
+  }
+  return result;
+}
+
+// the field value without the whitespace surrounding it
+inline slice trimValue(std::string_view s, slice value) noexcept {
+  while (value.begin < value.end &&
+         (s[value.begin] == ' ' || s[value.begin] == '\t')) {
+    value.begin++;
+  }
+  while (value.end > value.begin &&
+         (s[value.end - 1] == ' ' || s[value.end - 1] == '\t')) {
+    value.end--;
+  }
+  return value;
+}
+
+// split an indexed header line, the surrounding whitespace of the value is
+// left out, the value may be empty
+// return false if it's malformed
+inline bool scanHeaderLine(std::string_view s, slice line,
+                           headerLine &header) noexcept {
+  auto colon = findFirst(s, line.begin, notTokenChar{});
+  if (colon == line.begin || colon >= line.end || s[colon] != ':') {
+    return false;
+  }
+
+  header.name = {line.begin, static_cast<std::uint32_t>(colon)};
+  header.value =
+      trimValue(s, {static_cast<std::uint32_t>(colon + 1), line.end});
+  return true;
+}
+
+} // namespace ACPAcoro::httpScan
@@ -3,6 +3,7 @@
 #include "async/Epoll.hpp"
 #include "async/Loop.hpp"
 #include "async/Tasks.hpp"
+#include "http/Timeout.hpp"
 #include "tl/expected.hpp"
 #include "utils/DEBUG.hpp"
 #include "utils/ErrorHandle.hpp"
@@ -27,6 +28,7 @@
 #include <sys/types.h>
 #include <system_error>
 #include <unistd.h>
+#include <utility>
 
 namespace ACPAcoro {
 
@@ -138,10 +140,37 @@ struct serverSocket : public socketBase {
 };
 
 struct reactorSocket : public socketBase {
-  reactorSocket(int fd) : socketBase(fd) {
+  reactorSocket(int fd) : socketBase(fd), timeouts(this->fd) {
     // set socket to non-blocking
     checkError(fcntl(fd, F_SETFL, O_NONBLOCK)).or_else(throwUnexpected);
   }
+
+  // the poller of the shard may be dispatching an event of the socket on
+  // another thread, it frees the waiters once that's over
+  ~reactorSocket() {
+    if (poller != nullptr && fd >= 0) {
+      poller->deleteEvent(fd);
+      poller->retire(std::move(waiters));
+    }
+  }
+
+  // register the socket once with persistent edge triggered events,
+  // readable() and writable() wait for the edges of each direction
+  tl::expected<int, std::error_code> attach(epollInstance &epoll) {
+    epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = epollInstance::tagWaiters(waiters.get());
+    return epoll.addEvent(fd, &event).map([&](int ret) {
+      poller = &epoll;
+      return ret;
+    });
+  }
+
+  // suspend until the socket may be read, use it after EAGAIN
+  readinessAwaiter readable() { return {waiters->reader}; }
+
+  // suspend until the socket may be written, use it after EAGAIN
+  readinessAwaiter writable() { return {waiters->writer}; }
   tl::expected<int, std::error_code> read(char *buffer, int size) {
     if (fd < 0) {
       return tl::unexpected(make_error_code(socketError::readError));
@@ -175,11 +204,16 @@ struct reactorSocket : public socketBase {
     return checkError(::sendfile(fd, in_fd, offset, count));
   }
 
-  reactorSocket(reactorSocket &&other) : socketBase(std::move(other)) {}
+  // the registration and its waiters go with the socket
+  reactorSocket(reactorSocket &&other)
+      : socketBase(std::move(other)), poller(std::exchange(other.poller, {})),
+        waiters(std::move(other.waiters)),
+        timeouts(this->fd, std::move(other.timeouts)) {}
 
-  // static tbb::concurrent_hash_map<std::weak_ptr<reactorSocket>,
-  //                                 std::chrono::system_clock::time_point>
-  //     timeoutTable;
+  epollInstance *poller = nullptr;
+  // on the heap, they may outlive the socket, see ~reactorSocket()
+  std::unique_ptr<ioWaiters> waiters = std::make_unique<ioWaiters>();
+  connectionTimeouts timeouts;
 };
 
 using handlerType = std::function<Task<>(std::shared_ptr<reactorSocket>)>;
@@ -211,11 +245,8 @@ using handlerType = std::function<Task<>(std::shared_ptr<reactorSocket>)>;
 //   }
 // }
 
-inline Task<> acceptAll(std::unique_ptr<serverSocket> server,
-                        handlerType handler, epollInstance &epollInst
-                        // ,
-                        // threadPool &poolInst = threadPool::getInstance()
-) {
+inline Task<> acceptAll(std::shared_ptr<serverSocket> server,
+                        handlerType handler, epollInstance &epollInst) {
   sockaddr_storage addr;
   socklen_t addrlen = sizeof(addr);
 
@@ -233,25 +264,38 @@ inline Task<> acceptAll(std::unique_ptr<serverSocket> server,
 
         continue;
       } else {
-        throw std::system_error(errno, std::system_category());
+        throwException(std::system_error(errno, std::system_category()));
       }
     }
     auto client = std::make_shared<reactorSocket>(clientfd);
     // std::println("Accepted connection on fd {}", clientfd);
 
-    auto task = handler(client);
-    epoll_event event;
-    event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
-    event.data.ptr = task.detach().address();
-
-    epollInst
-        .addEvent(clientfd, &event)
+    client->attach(epollInst).or_else([](auto const &) { std::terminate(); });
 
-        .or_else([](auto const &) { std::terminate(); });
+    // the handler waits with readable() / writable() on EAGAIN,
+    // run it on the worker polling this instance
+    epollInst.getPool().addTaskLocal(forget(handler(client)).release());
   }
   co_return;
 };
 
+// accept on every shard
+// the listener is registered with EPOLLEXCLUSIVE in each shard so only one
+// shard is woken for a new connection, and the connection is handled by it
+inline void acceptAll(std::shared_ptr<serverSocket> server, handlerType handler,
+                      shardedEpoll &epolls) {
+  for (size_t i = 0; i < epolls.size(); i++) {
+    auto &shard = epolls.shard(i);
+    auto acceptor = acceptAll(server, handler, shard).detach();
+    epolls.getPool().adopt(acceptor);
+
+    epoll_event event;
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.ptr = acceptor.address();
+    shard.addEvent(server->fd, &event).or_else(throwUnexpected);
+  }
+}
+
 } // namespace ACPAcoro
 
 namespace std {
@@ -0,0 +1,203 @@
+#pragma once
+
+#include "async/Loop.hpp"
+#include "async/TimingWheel.hpp"
+#include "utils/Clock.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <sys/socket.h>
+#include <utility>
+
+namespace ACPAcoro {
+
+// zero disables the timeout
+struct timeoutConfig {
+  // keep-alive wait for the next request
+  std::chrono::milliseconds idle{std::chrono::seconds(60)};
+  // from the first byte of a request to the end of its headers,
+  // not extended by later bytes so a slow client cannot hold it forever
+  std::chrono::milliseconds headerRead{std::chrono::seconds(10)};
+  // longest time a response may make no send progress
+  std::chrono::milliseconds sendStall{std::chrono::seconds(30)};
+};
+
+// timeouts of a connection
+//
+// one timer for the read side (idle, then header read) and one for the send
+// side, both on the timing wheel of a worker, so arming, moving and
+// disarming are O(1) and nothing is allocated per connection.
+// the send timer is shared by the responses of the connection being sent,
+// it's armed while any of them is.
+// an expired connection is shut down, the pending read or send of its
+// handler fails and the handler exits as for a closed peer.
+struct connectionTimeouts {
+  inline static timeoutConfig defaults{};
+
+  // fd refers to the fd of the owning socket, so it follows socket moves
+  explicit connectionTimeouts(int const &fd,
+                              timeoutConfig const &config = defaults,
+                              threadPool &pool = threadPool::current())
+      : fd(fd), config(config), pool(pool) {
+    for (auto node : {&readTimer, &sendTimer}) {
+      node->self = this;
+      node->onExpire = &expire;
+      pool.bindTimer(*node);
+    }
+  }
+
+  // the timers are not moved, they are disarmed on both sides
+  connectionTimeouts(int const &fd, connectionTimeouts &&other)
+      : connectionTimeouts(fd, other.config, other.pool) {
+    other.disarm();
+  }
+
+  connectionTimeouts &operator=(connectionTimeouts &&other) {
+    disarm();
+    other.disarm();
+    config = other.config;
+    return *this;
+  }
+
+  ~connectionTimeouts() { disarm(); }
+
+  connectionTimeouts(connectionTimeouts const &) = delete;
+  connectionTimeouts &operator=(connectionTimeouts const &) = delete;
+
+  // waiting for the next request of a keep-alive connection
+  void waitRequest() {
+    readPhase = phase::idle;
+    arm(readTimer, config.idle);
+  }
+
+  // bytes of a request arrived, the first call starts the header deadline
+  // later calls cost nothing
+  void readProgress() {
+    if (readPhase == phase::headers) {
+      return;
+    }
+    readPhase = phase::headers;
+    arm(readTimer, config.headerRead);
+  }
+
+  // the request is read
+  void requestRead() {
+    readPhase = phase::none;
+    pool.cancelTimer(readTimer);
+  }
+
+  // a response being sent, from sendStart() to its destruction
+  class activeSend {
+  public:
+    explicit activeSend(connectionTimeouts *owner) : owner(owner) {}
+    activeSend(activeSend &&other)
+        : owner(std::exchange(other.owner, nullptr)) {}
+    activeSend &operator=(activeSend &&) = delete;
+    ~activeSend() {
+      if (owner != nullptr) {
+        owner->sendDone();
+      }
+    }
+
+  private:
+    connectionTimeouts *owner;
+  };
+
+  // a response starts to be sent, the send timer is disarmed once every
+  // response started is done
+  [[nodiscard]] activeSend sendStart() {
+    std::scoped_lock<decltype(sendMutex)> lock(sendMutex);
+    activeSends++;
+    armSend();
+    return activeSend(this);
+  }
+
+  // a send made progress, called for every chunk
+  // the timer is moved only once the deadline moved by a tick of the wheel
+  void sendProgress() {
+    if (config.sendStall <= std::chrono::milliseconds::zero()) {
+      return;
+    }
+    auto deadline = tickOf(coarseClock::refresh() + config.sendStall);
+    if (deadline == sendDeadline.load(std::memory_order::relaxed)) {
+      return;
+    }
+    std::scoped_lock<decltype(sendMutex)> lock(sendMutex);
+    if (activeSends > 0) {
+      armSend();
+    }
+  }
+
+  // whether the connection was shut down by a timeout
+  bool expired() const { return timedOut.load(std::memory_order::relaxed); }
+
+private:
+  struct expiryNode : timerNode {
+    connectionTimeouts *self = nullptr;
+  };
+
+  enum class phase { none, idle, headers };
+
+  void disarm() {
+    readPhase = phase::none;
+    pool.cancelTimer(readTimer);
+    pool.cancelTimer(sendTimer);
+  }
+
+  void sendDone() {
+    std::scoped_lock<decltype(sendMutex)> lock(sendMutex);
+    if (--activeSends == 0) {
+      pool.cancelTimer(sendTimer);
+      sendDeadline.store(0, std::memory_order::relaxed);
+    }
+  }
+
+  // the send mutex must be held
+  void armSend() {
+    if (config.sendStall <= std::chrono::milliseconds::zero()) {
+      return;
+    }
+    auto deadline = coarseClock::refresh() + config.sendStall;
+    sendDeadline.store(tickOf(deadline), std::memory_order::relaxed);
+    pool.resetTimer(sendTimer, deadline);
+  }
+
+  static std::int64_t tickOf(coarseClock::time_point time) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               time.time_since_epoch())
+        .count();
+  }
+
+  void arm(expiryNode &node, std::chrono::milliseconds timeout) {
+    if (timeout <= std::chrono::milliseconds::zero()) {
+      pool.cancelTimer(node);
+      return;
+    }
+    // a coarse read, the handler may run outside the workers refreshing it
+    pool.resetTimer(node, coarseClock::refresh() + timeout);
+  }
+
+  static void expire(timerNode &node) {
+    auto self = static_cast<expiryNode &>(node).self;
+    self->timedOut.store(true, std::memory_order::relaxed);
+    ::shutdown(self->fd, SHUT_RDWR);
+  }
+
+  int const &fd;
+  timeoutConfig config;
+  threadPool &pool;
+  phase readPhase = phase::none;
+  std::atomic<bool> timedOut = false;
+  // the responses being sent, the arms and disarms of the send timer are
+  // serialized, the moves of sendProgress only take the lock once a tick
+  std::mutex sendMutex;
+  int activeSends = 0;
+  // tick of the deadline of the send timer, 0 when it's disarmed
+  std::atomic<std::int64_t> sendDeadline = 0;
+  expiryNode readTimer;
+  expiryNode sendTimer;
+};
+
+} // namespace ACPAcoro
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "async/Tasks.hpp"
+#include "async/Uring.hpp"
+#include "tl/expected.hpp"
+#include "uring/Socket.hpp"
+
+#include <cerrno>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <sys/socket.h>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace ACPAcoro {
+
+// keep-alive client sockets keyed by endpoint
+//
+// acquire() hands out an idle socket of the endpoint if there is one,
+// otherwise a new connection is made on the ring.
+// release() gives the socket back for reuse, sockets marked closed or
+// exceeding maxIdle per endpoint are dropped (closed).
+struct connectionPool {
+  using socketPtr = std::unique_ptr<asyncClientSocket>;
+
+  Task<tl::expected<socketPtr, std::error_code>>
+  acquire(endpoint const &remote) {
+    if (auto idle = takeIdle(remote)) {
+      co_return std::move(idle);
+    }
+    co_return co_await asyncClientSocket::connect(remote, uring);
+  }
+
+  void release(socketPtr sock) {
+    if (sock == nullptr || sock->closed) {
+      return;
+    }
+    std::scoped_lock<decltype(mutex)> lock(mutex);
+    auto &idle = idleSockets[sock->remote];
+    if (idle.size() < maxIdle) {
+      idle.push_back(std::move(sock));
+    }
+  }
+
+  // drop every idle socket
+  void clear() {
+    std::scoped_lock<decltype(mutex)> lock(mutex);
+    idleSockets.clear();
+  }
+
+  connectionPool(uringInstance &ring, std::size_t maxIdlePerEndpoint = 64)
+      : uring(ring), maxIdle(maxIdlePerEndpoint) {}
+
+  connectionPool(connectionPool const &) = delete;
+  connectionPool &operator=(connectionPool const &) = delete;
+
+private:
+  // pop idle sockets until one is still alive
+  socketPtr takeIdle(endpoint const &remote) {
+    std::scoped_lock<decltype(mutex)> lock(mutex);
+    auto iter = idleSockets.find(remote);
+    if (iter == idleSockets.end()) {
+      return nullptr;
+    }
+
+    auto &idle = iter->second;
+    while (!idle.empty()) {
+      auto sock = std::move(idle.back());
+      idle.pop_back();
+      if (alive(*sock)) {
+        return sock;
+      }
+    }
+    return nullptr;
+  }
+
+  // an idle keep-alive socket must have nothing to read,
+  // EOF or unexpected data means it cannot be reused
+  static bool alive(asyncClientSocket &sock) {
+    char byte;
+    auto ret = ::recv(sock.fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+  }
+
+  uringInstance &uring;
+  std::size_t maxIdle;
+  std::mutex mutex;
+  std::unordered_map<endpoint, std::vector<socketPtr>> idleSockets;
+};
+
+} // namespace ACPAcoro
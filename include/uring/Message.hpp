@@ -0,0 +1,99 @@
+#pragma once
+
+// cross ring message passing with IORING_OP_MSG_RING
+//
+// a ringMailbox lives on the receiving ring, every message posted to it
+// runs the handler with the message value on the worker reaping that ring,
+// e.g. an accepted fd handed over by the accepting ring or a wakeup token.
+//
+// the value is carried in the cqe res field, so plain fds can be handed over
+// as they are shared by all rings of the process.
+//
+#include "async/Tasks.hpp"
+#include "async/Uring.hpp"
+#include "tl/expected.hpp"
+
+#include <coroutine>
+#include <system_error>
+#include <type_traits>
+#include <unistd.h>
+
+namespace ACPAcoro {
+
+struct msgRingAwaiter {
+  bool await_ready() { return false; }
+  bool await_suspend(std::coroutine_handle<> coro) {
+    callerData.handle = coro;
+    callerData.multishot = false;
+    auto addRes =
+        uring.prep_msg_ring(targetRingFd, value, target, &callerData);
+    if (!addRes) {
+      callerData.returnVal = tl::unexpected(addRes.error());
+      return false;
+    }
+    return true;
+  }
+
+  tl::expected<int, std::error_code> await_resume() {
+    return callerData.returnVal;
+  }
+
+  msgRingAwaiter(int argTargetRingFd, unsigned argValue,
+                 uringInstance::userData *argTarget, uringInstance &sourceRing)
+      : targetRingFd(argTargetRingFd), value(argValue), target(argTarget),
+        uring(sourceRing) {}
+
+  int targetRingFd;
+  unsigned value;
+  uringInstance::userData *target;
+  uringInstance &uring;
+  uringInstance::userData callerData;
+};
+
+// receiving end of the messages of a ring
+// must outlive every message posted to it
+template <typename Handler>
+  requires std::is_invocable_r_v<Task<>, Handler &, int>
+struct ringMailbox {
+
+  ringMailbox(uringInstance &owner, Handler handler)
+      : ring(owner), handler(std::move(handler)) {
+    data.multishot = false;
+    data.mailbox = true;
+    data.multishotHandler = &invokeHandler;
+    data.handlerContext = &this->handler;
+    data.handlerType = &dispatchTag<ringMailbox>;
+  }
+
+  ringMailbox(ringMailbox const &) = delete;
+  ringMailbox &operator=(ringMailbox const &) = delete;
+
+  // post a value to this mailbox from the source ring
+  // resumes when the message is delivered to the target ring
+  auto post(int value, uringInstance &source) {
+    return msgRingAwaiter(ring.fd(), static_cast<unsigned>(value), &data,
+                          source);
+  }
+
+  static std::coroutine_handle<> invokeHandler(void *handler, int value) {
+    return forget((*static_cast<Handler *>(handler))(value)).release();
+  }
+
+  uringInstance &ring;
+  Handler handler;
+  uringInstance::userData data;
+};
+
+// hand over a connection to the ring owning the mailbox
+// the fd is closed if the handoff fails
+template <typename Handler>
+Task<tl::expected<int, std::error_code>>
+handoffConnection(int fd, ringMailbox<Handler> &target, uringInstance &source) {
+  auto postRes = co_await target.post(fd, source);
+  if (!postRes) {
+    ::close(fd);
+  }
+  co_return std::move(postRes);
+}
+
+} // namespace ACPAcoro
@@ -10,20 +10,30 @@
 #include "async/Uring.hpp"
 #include "http/Socket.hpp"
 #include "utils/DEBUG.hpp"
+#include "utils/ErrorHandle.hpp"
 #include <coroutine>
 #include <cstddef>
+#include <cstring>
 #include <functional>
 #include <memory>
+#include <netdb.h>
+#include <string>
+#include <sys/socket.h>
 #include <system_error>
+#include <thread>
+#include <type_traits>
 
 namespace ACPAcoro {
 
 struct sendAwaiter {
   bool await_ready() { return false; }
-  bool await_suspend(std::coroutine_handle<> coro) {
+  template <typename P> bool await_suspend(std::coroutine_handle<P> coro) {
     callerData.handle = coro;
     callerData.multishot = false;
-    auto addRes = uring.prep_send(fd, buf, len, flags, &callerData);
+    auto addRes =
+        cancelHook.submit(cancelSourceOf(coro), uring, &callerData, [&] {
+          return uring.prep_send(fd, buf, len, flags, &callerData);
+        });
     if (!addRes) {
       callerData.returnVal = tl::unexpected(addRes.error());
       return false;
@@ -32,6 +42,7 @@ struct sendAwaiter {
   }
 
   tl::expected<int, std::error_code> await_resume() {
+    cancelHook.disarm();
     return callerData.returnVal;
   }
 
@@ -46,14 +57,18 @@ struct sendAwaiter {
   int flags;
   uringInstance &uring;
   uringInstance::userData callerData;
+  uringCancelHook cancelHook;
 };
 
 struct recvAwaiter {
   bool await_ready() { return false; }
-  bool await_suspend(std::coroutine_handle<> coro) {
+  template <typename P> bool await_suspend(std::coroutine_handle<P> coro) {
     callerData.handle = coro;
     callerData.multishot = false;
-    auto addRes = uring.prep_recv(fd, buf, len, flags, &callerData);
+    auto addRes =
+        cancelHook.submit(cancelSourceOf(coro), uring, &callerData, [&] {
+          return uring.prep_recv(fd, buf, len, flags, &callerData);
+        });
     if (!addRes) {
       callerData.returnVal = tl::unexpected(addRes.error());
       return false;
@@ -62,6 +77,7 @@ struct recvAwaiter {
   }
 
   tl::expected<int, std::error_code> await_resume() {
+    cancelHook.disarm();
     return callerData.returnVal;
   }
 
@@ -76,16 +92,64 @@ struct recvAwaiter {
   int flags;
   uringInstance &uring;
   uringInstance::userData callerData;
+  uringCancelHook cancelHook;
 };
 
-struct multishotAcceptAwaiter {
+struct connectAwaiter {
   bool await_ready() { return false; }
-  bool await_suspend(std::coroutine_handle<> coro) {
+  template <typename P> bool await_suspend(std::coroutine_handle<P> coro) {
+    callerData.handle = coro;
+    callerData.multishot = false;
+    auto addRes =
+        cancelHook.submit(cancelSourceOf(coro), uring, &callerData, [&] {
+          return uring.prep_connect(fd, reinterpret_cast<sockaddr *>(&addr),
+                                    len, &callerData);
+        });
+    if (!addRes) {
+      callerData.returnVal = tl::unexpected(addRes.error());
+      return false;
+    }
+    return true;
+  }
+
+  tl::expected<int, std::error_code> await_resume() {
+    cancelHook.disarm();
+    return callerData.returnVal;
+  }
+
+  // the address is copied, it has to live until the connect completes
+  connectAwaiter(int argFd, sockaddr const *argAddr, socklen_t argLen,
+                 uringInstance &targetRing)
+      : fd(argFd), len(argLen), uring(targetRing) {
+    memcpy(&addr, argAddr, argLen);
+  }
+
+  int fd;
+  sockaddr_storage addr;
+  socklen_t len;
+  uringInstance &uring;
+  uringInstance::userData callerData;
+  uringCancelHook cancelHook;
+};
+
+// a connection handler is called with the accepted fd and returns the
+// coroutine handling the connection
+template <typename Handler>
+concept connectionHandler = std::is_invocable_r_v<Task<>, Handler &, int>;
+
+template <connectionHandler Handler> struct multishotAcceptAwaiter {
+  bool await_ready() { return false; }
+  template <typename P> bool await_suspend(std::coroutine_handle<P> coro) {
     callerData.handle = coro;
     callerData.multishot = true;
-    callerData.multishotHandler = multishotHandler;
-    auto addRes = uring.prep_multishot_accept_and_process(fd, nullptr, nullptr,
-                                                          0, &callerData);
+    callerData.multishotHandler = &invokeHandler;
+    callerData.handlerContext = &multishotHandler;
+    callerData.handlerType = &dispatchTag<multishotAcceptAwaiter>;
+    auto addRes =
+        cancelHook.submit(cancelSourceOf(coro), uring, &callerData, [&] {
+          return uring.prep_multishot_accept_and_process(
+              fd, nullptr, nullptr, 0, &callerData);
+        });
     if (!addRes) {
       callerData.returnVal = tl::unexpected(addRes.error());
       return false;
@@ -94,17 +158,23 @@ struct multishotAcceptAwaiter {
   }
 
   tl::expected<int, std::error_code> await_resume() {
+    cancelHook.disarm();
     return callerData.returnVal;
   }
 
-  multishotAcceptAwaiter(int file, std::function<Task<>(int)> handler,
-                         uringInstance &targetRing)
-      : fd(file), multishotHandler(handler), uring(targetRing) {}
+  // the handler type is known here, so the call is direct and can be inlined
+  static std::coroutine_handle<> invokeHandler(void *handler, int clientFd) {
+    return forget((*static_cast<Handler *>(handler))(clientFd)).release();
+  }
+
+  multishotAcceptAwaiter(int file, Handler handler, uringInstance &targetRing)
+      : fd(file), multishotHandler(std::move(handler)), uring(targetRing) {}
 
   int fd;
-  std::function<Task<>(int)> multishotHandler;
+  Handler multishotHandler;
   uringInstance &uring;
   uringInstance::userData callerData;
+  uringCancelHook cancelHook;
 };
 
 // TODO: implement all op awaiters
@@ -120,11 +190,14 @@ struct asyncSocket : socketBase {
     return recvAwaiter(fd, buf, len, flags, uring);
   }
 
-  asyncSocket(int fd) : socketBase(fd) {}
+  asyncSocket(int fd) : socketBase(fd), timeouts(this->fd) {}
 
-  asyncSocket(asyncSocket &&other) : socketBase(std::move(other)) {}
+  asyncSocket(asyncSocket &&other)
+      : socketBase(std::move(other)),
+        timeouts(this->fd, std::move(other.timeouts)) {}
   asyncSocket &operator=(asyncSocket &&other) {
     socketBase::operator=(std::move(other));
+    timeouts = std::move(other.timeouts);
     return *this;
   }
 
@@ -132,18 +205,157 @@ struct asyncSocket : socketBase {
   asyncSocket &operator=(asyncSocket &) = delete;
 
   bool closed = false;
+  connectionTimeouts timeouts;
+};
+
+// host and port of a remote server
+struct endpoint {
+  std::string host;
+  std::string port;
+
+  bool operator==(endpoint const &) const = default;
+};
+
+// the EAI_* codes of getaddrinfo
+inline auto const &resolveErrorCode() {
+  static struct resolveErrorCategory : public std::error_category {
+    char const *name() const noexcept override { return "resolveError"; }
+
+    std::string message(int c) const override { return gai_strerror(c); }
+  } instance;
+  return instance;
+}
+
+// EAI_SYSTEM carries its error in errno
+inline std::error_code makeResolveError(int gaiCode) {
+  if (gaiCode == EAI_SYSTEM) {
+    return {errno, std::generic_category()};
+  }
+  return {gaiCode, resolveErrorCode()};
+}
+
+using addrinfoPtr = std::unique_ptr<addrinfo, decltype(&freeaddrinfo)>;
+
+// resolve an endpoint without blocking the worker
+// a numeric host and port are converted at once, a name is looked up by
+// getaddrinfo on a thread of its own, then the coroutine is resumed on
+// the pool it was suspended from. the lookup can't be cancelled
+struct resolveAwaiter {
+  bool await_ready() {
+    // no lookup is made with these flags, a name fails with EAI_NONAME
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    auto ret = lookUp();
+    if (ret == EAI_NONAME) {
+      hints.ai_flags = 0;
+      return false;
+    }
+    return true;
+  }
+
+  void await_suspend(std::coroutine_handle<> coro) {
+    std::thread([this, coro, &pool = threadPool::current()] {
+      lookUp();
+      pool.addTask(coro);
+    }).detach();
+  }
+
+  tl::expected<addrinfoPtr, std::error_code> await_resume() {
+    if (ret != 0) {
+      return tl::unexpected(error);
+    }
+    return addrinfoPtr(addrs, &freeaddrinfo);
+  }
+
+  explicit resolveAwaiter(endpoint const &remote) : remote(remote) {
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+  }
+
+  endpoint const &remote;
+  addrinfo hints = {};
+  addrinfo *addrs = nullptr;
+  int ret = 0;
+  std::error_code error;
+
+private:
+  int lookUp() {
+    ret = getaddrinfo(remote.host.c_str(), remote.port.c_str(), &hints,
+                      &addrs);
+    if (ret != 0) {
+      error = makeResolveError(ret);
+    }
+    return ret;
+  }
+};
+
+struct asyncClientSocket : asyncSocket {
+
+  /**   @brief Resolve the endpoint and connect to the first reachable address
+   *    @retval
+   *    1) resolveErrorCode(): the EAI_* code when the endpoint cannot be
+   *       resolved, e.g. EAI_NONAME or EAI_AGAIN
+   *
+   *    2) other errors: the error of the last connect attempt
+   */
+  static Task<tl::expected<std::unique_ptr<asyncClientSocket>, std::error_code>>
+  connect(endpoint const &remote, uringInstance &uring) {
+    auto resolved = co_await resolveAwaiter(remote);
+    if (!resolved) {
+      co_return tl::unexpected(resolved.error());
+    }
+    auto addrs = resolved.value().get();
+
+    std::error_code lastError = make_error_code(std::errc::host_unreachable);
+    for (auto addr = addrs; addr != nullptr; addr = addr->ai_next) {
+      auto sock = checkError(socket(addr->ai_family,
+                                    addr->ai_socktype | SOCK_CLOEXEC,
+                                    addr->ai_protocol));
+      if (!sock) {
+        lastError = sock.error();
+        continue;
+      }
+
+      auto client = std::make_unique<asyncClientSocket>(sock.value(), remote);
+
+      auto connectRes = co_await client->connectTo(addr->ai_addr,
+                                                   addr->ai_addrlen, uring);
+
+      if (connectRes) {
+        co_return std::move(client);
+      }
+      lastError = connectRes.error();
+    }
+
+    co_return tl::unexpected(lastError);
+  }
+
+  connectAwaiter connectTo(sockaddr const *addr, socklen_t len,
+                           uringInstance &uring) {
+    return connectAwaiter(fd, addr, len, uring);
+  }
+
+  asyncClientSocket(int fd, endpoint remote)
+      : asyncSocket(fd), remote(std::move(remote)) {}
+
+  endpoint remote;
 };
 
 // use multishot to process sockets
-inline Task<> asyncAccept(std::unique_ptr<serverSocket> server,
-                          std::function<Task<>(int)> handler,
-                          uringInstance &uring) {
+// every accepted connection is spawned on a worker of the ring's pool
+template <connectionHandler Handler>
+Task<> asyncAccept(std::unique_ptr<serverSocket> server, Handler handler,
+                   uringInstance &uring) {
   // helper awaiter
   debug("Ready to accept");
+  auto cancel = co_await currentCancel{};
   while (true) {
     auto acceptRes =
         co_await multishotAcceptAwaiter(server->fd, handler, uring);
 
+    if (cancel != nullptr && cancel->cancelled()) {
+      co_return;
+    }
+
     if (acceptRes ||
         acceptRes.error() ==
             make_error_code(std::errc::operation_would_block) ||
@@ -155,9 +367,19 @@ inline Task<> asyncAccept(std::unique_ptr<serverSocket> server,
     } else {
       errorlog("Failed to accept: {}, {}", acceptRes.error().category().name(),
                acceptRes.error().message());
-      throw std::system_error(acceptRes.error());
+      throwException(std::system_error(acceptRes.error()));
     }
   }
 }
 
 } // namespace ACPAcoro
+
+namespace std {
+template <> struct hash<ACPAcoro::endpoint> {
+  size_t operator()(ACPAcoro::endpoint const &e) const {
+    return std::hash<std::string>{}(e.host) ^
+           (std::hash<std::string>{}(e.port) << 1);
+  }
+};
+
+} // namespace std
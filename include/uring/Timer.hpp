@@ -0,0 +1,149 @@
+#pragma once
+
+// timers serviced by IORING_OP_TIMEOUT on the ring
+//
+// the expiry arrives as a cqe through reapIOs like any other request, so a
+// uring server needs no timer thread and no extra wakeup to sleep.
+// steady_clock is CLOCK_MONOTONIC, the clock the kernel uses for
+// IORING_TIMEOUT_ABS, so deadlines are passed to the kernel as they are.
+//
+#include "async/Tasks.hpp"
+#include "async/Uring.hpp"
+#include "tl/expected.hpp"
+
+#include <chrono>
+#include <coroutine>
+#include <system_error>
+#include <type_traits>
+
+#ifndef IORING_TIMEOUT_MULTISHOT
+#define IORING_TIMEOUT_MULTISHOT (1U << 6)
+#endif
+
+namespace ACPAcoro {
+
+inline __kernel_timespec toKernelTimespec(std::chrono::nanoseconds time) {
+  if (time.count() < 0) {
+    time = std::chrono::nanoseconds::zero();
+  }
+  auto sec = std::chrono::duration_cast<std::chrono::seconds>(time);
+  return {.tv_sec = sec.count(), .tv_nsec = (time - sec).count()};
+}
+
+// the timespec lives in the awaiter, which stays in the suspended frame
+// until the cqe arrives
+struct uringTimerAwaiter {
+  bool await_ready() { return false; }
+  template <typename P> bool await_suspend(std::coroutine_handle<P> coro) {
+    callerData.handle = coro;
+    callerData.multishot = false;
+    callerData.timer = true;
+    auto addRes =
+        cancelHook.submit(cancelSourceOf(coro), uring, &callerData, [&] {
+          return uring.prep_timeout(&timeSpec, 0, flags, &callerData);
+        });
+    if (!addRes) {
+      callerData.returnVal = tl::unexpected(addRes.error());
+      return false;
+    }
+    return true;
+  }
+
+  tl::expected<int, std::error_code> await_resume() {
+    cancelHook.disarm();
+    return callerData.returnVal;
+  }
+
+  uringTimerAwaiter(std::chrono::steady_clock::duration duration,
+                    uringInstance &ring)
+      : timeSpec(toKernelTimespec(duration)), flags(0), uring(ring) {}
+
+  uringTimerAwaiter(std::chrono::steady_clock::time_point time,
+                    uringInstance &ring)
+      : timeSpec(toKernelTimespec(time.time_since_epoch())),
+        flags(IORING_TIMEOUT_ABS), uring(ring) {}
+
+  uringTimerAwaiter(uringTimerAwaiter const &) = delete;
+  uringTimerAwaiter &operator=(uringTimerAwaiter const &) = delete;
+
+  __kernel_timespec timeSpec;
+  unsigned flags;
+  uringInstance &uring;
+  uringInstance::userData callerData;
+  uringCancelHook cancelHook;
+};
+
+inline uringTimerAwaiter sleepFor(std::chrono::steady_clock::duration duration,
+                                  uringInstance &uring) {
+  return uringTimerAwaiter(duration, uring);
+}
+
+inline uringTimerAwaiter sleepUntil(std::chrono::steady_clock::time_point time,
+                                    uringInstance &uring) {
+  return uringTimerAwaiter(time, uring);
+}
+
+// multishot timeout for periodic work (kernel 6.4+)
+// every expiry spawns handler(tick), tick counts from 1.
+// repeat 0 fires until the ring goes away, otherwise the awaiter resumes
+// after repeat expiries
+template <typename Handler>
+  requires std::is_invocable_r_v<Task<>, Handler &, int>
+struct periodicTimerAwaiter {
+  bool await_ready() { return false; }
+  template <typename P> bool await_suspend(std::coroutine_handle<P> coro) {
+    callerData.handle = coro;
+    callerData.multishot = true;
+    callerData.timer = true;
+    callerData.multishotHandler = &invokeHandler;
+    callerData.handlerContext = this;
+    callerData.handlerType = &dispatchTag<periodicTimerAwaiter>;
+    auto addRes =
+        cancelHook.submit(cancelSourceOf(coro), uring, &callerData, [&] {
+          return uring.prep_timeout(&timeSpec, repeat,
+                                    IORING_TIMEOUT_MULTISHOT, &callerData);
+        });
+    if (!addRes) {
+      callerData.returnVal = tl::unexpected(addRes.error());
+      return false;
+    }
+    return true;
+  }
+
+  tl::expected<int, std::error_code> await_resume() {
+    cancelHook.disarm();
+    return callerData.returnVal;
+  }
+
+  // cqes of a ring are reaped by one coroutine, ticks needs no lock
+  static std::coroutine_handle<> invokeHandler(void *awaiter, int) {
+    auto self = static_cast<periodicTimerAwaiter *>(awaiter);
+    return forget(self->handler(++self->ticks)).release();
+  }
+
+  periodicTimerAwaiter(std::chrono::steady_clock::duration interval,
+                       Handler handler, unsigned repeat, uringInstance &ring)
+      : timeSpec(toKernelTimespec(interval)), repeat(repeat),
+        handler(std::move(handler)), uring(ring) {}
+
+  periodicTimerAwaiter(periodicTimerAwaiter const &) = delete;
+  periodicTimerAwaiter &operator=(periodicTimerAwaiter const &) = delete;
+
+  __kernel_timespec timeSpec;
+  unsigned repeat;
+  int ticks = 0;
+  Handler handler;
+  uringInstance &uring;
+  uringInstance::userData callerData;
+  uringCancelHook cancelHook;
+};
+
+template <typename Handler>
+  requires std::is_invocable_r_v<Task<>, Handler &, int>
+auto every(std::chrono::steady_clock::duration interval, Handler handler,
+           uringInstance &uring, unsigned repeat = 0) {
+  return periodicTimerAwaiter<Handler>(interval, std::move(handler), repeat,
+                                       uring);
+}
+
+} // namespace ACPAcoro
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "utils/ErrorHandle.hpp"
+
 #include <atomic>
 #include <bitset>
 #include <cstddef>
@@ -41,7 +43,7 @@ public:
     }
 
     // std::println("Buffer run out");
-    throw bufferRunOut();
+    throwException(bufferRunOut());
   }
 
   void returnBuffer(std::span<T> buffer) {
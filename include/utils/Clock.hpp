@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <string_view>
+
+namespace ACPAcoro {
+
+// cached monotonic time for the hot path
+//
+// the workers of the thread pool refresh it once per scheduler round from
+// CLOCK_MONOTONIC_COARSE, so now() is a plain load shared by timers,
+// timeouts and metrics. the time may lag behind the real clock by a tick of
+// the kernel or the run time of a task, it's never ahead of it.
+// CLOCK_MONOTONIC_COARSE counts from the same epoch as CLOCK_MONOTONIC,
+// so the time points are steady_clock time points.
+struct coarseClock {
+  using duration = std::chrono::steady_clock::duration;
+  using time_point = std::chrono::steady_clock::time_point;
+
+  static time_point now() noexcept {
+    return time_point(duration(cached.load(std::memory_order::relaxed)));
+  }
+
+  // read CLOCK_MONOTONIC_COARSE, it costs no syscall
+  static time_point refresh() noexcept {
+    return advance(CLOCK_MONOTONIC_COARSE);
+  }
+
+  // read the precise clock, e.g. after sleeping until a deadline
+  static time_point sync() noexcept { return advance(CLOCK_MONOTONIC); }
+
+private:
+  static int64_t read(clockid_t clock) noexcept {
+    timespec ts;
+    clock_gettime(clock, &ts);
+    return std::chrono::duration_cast<duration>(
+               std::chrono::seconds(ts.tv_sec) +
+               std::chrono::nanoseconds(ts.tv_nsec))
+        .count();
+  }
+
+  static time_point advance(clockid_t clock) noexcept {
+    auto time = read(clock);
+
+    // only written when the time moves, so the workers don't fight for the
+    // cache line, and a coarse read can't move it back after a precise one
+    auto old = cached.load(std::memory_order::relaxed);
+    while (old < time && !cached.compare_exchange_weak(
+                             old, time, std::memory_order::relaxed)) {
+    }
+    return now();
+  }
+
+  inline static std::atomic<int64_t> cached = read(CLOCK_MONOTONIC);
+};
+
+// the value of the http Date header, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+// formatted once per second per thread, valid until the next call on
+// the same thread
+inline std::string_view httpDate() noexcept {
+  thread_local time_t cachedSecond = -1;
+  thread_local char buffer[32];
+  thread_local size_t length = 0;
+
+  timespec ts;
+  clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+  if (ts.tv_sec != cachedSecond) {
+    tm gmt;
+    gmtime_r(&ts.tv_sec, &gmt);
+    length = strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &gmt);
+    cachedSecond = ts.tv_sec;
+  }
+  return {buffer, length};
+}
+
+} // namespace ACPAcoro
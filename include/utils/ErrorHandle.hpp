@@ -1,12 +1,33 @@
-
 #pragma once
 
 #include "tl/expected.hpp"
+#include "utils/DEBUG.hpp"
 
+#include <cstdlib>
 #include <system_error>
+#include <utility>
+
+// 0 when built with -fno-exceptions, then a throw logs and aborts and
+// the promises keep no room for an exception
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS)
+#define ACPACORO_EXCEPTIONS 1
+#else
+#define ACPACORO_EXCEPTIONS 0
+#endif
 
 namespace ACPAcoro {
 
+inline constexpr bool exceptionsEnabled = ACPACORO_EXCEPTIONS;
+
+template <typename E> [[noreturn]] void throwException(E &&e) {
+#if ACPACORO_EXCEPTIONS
+  throw std::forward<E>(e);
+#else
+  errorlog("{}", e.what());
+  std::abort();
+#endif
+}
+
 inline tl::expected<int, std::error_code> checkError(int ret) {
   if (ret < 0) {
     return tl::unexpected(std::make_error_code(static_cast<std::errc>(errno)));
@@ -14,8 +35,8 @@ inline tl::expected<int, std::error_code> checkError(int ret) {
   return ret;
 }
 
-inline void throwUnexpected(std::error_code const &e) {
-  throw std::system_error(e);
+[[noreturn]] inline void throwUnexpected(std::error_code const &e) {
+  throwException(std::system_error(e));
 }
 
-} // namespace ACPAcoro
\ No newline at end of file
+} // namespace ACPAcoro
@@ -1,5 +1,9 @@
 #pragma once
 
+#include "async/Sync.hpp"
+#include "async/Tasks.hpp"
+#include "utils/ErrorHandle.hpp"
+
 #include <cstddef>
 #include <list>
 #include <memory>
@@ -42,6 +46,9 @@ struct cacheBase {
   // get a value from the cache, if the key is not in the cache, create a new
   // value and change the cache with specific strategy
   virtual valueType get(Key const &) = 0;
+  // get() for coroutines, a miss already being built by another coroutine
+  // is awaited instead of built again
+  virtual Task<valueType> fetch(Key) = 0;
   // construct a new value with the key and put it into the cache
   virtual bool put(Key const &) = 0;
   virtual void refresh() = 0;
@@ -67,30 +74,64 @@ struct lruCache : public cacheBase<Key, ValueBuilder> {
   using iteratorMapType = std::unordered_map<Key, iteratorType>;
 
   // Get the value of the key if the key exists in the cache,
-  // thread safe
+  // otherwise build it and put it into the cache.
+  // thread safe, the value is built outside the lock so a slow build,
+  // e.g. reading a file, doesn't stall the lookups of other keys
   valueType get(Key const &key) override {
-    // thread safe
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      if (auto it = map.find(key); it != map.end()) {
+        touch(it->second);
+        return *it->second;
+      }
+    }
+
+    auto newNode = this->builder.build(key);
+    if (newNode == nullptr) {
+      return nullptr;
+    }
+
     std::unique_lock<std::mutex> lock(mtx);
+    return insert(key, std::move(newNode));
+  }
 
-    // if the key is not in the cache, put it into the cache
-    if (!map.contains(key)) {
-      // if the put operation fails, return nullptr
-      if (!put(key)) {
-        return nullptr;
+  // the first miss of a key builds its value, the following ones park on
+  // the event of the build until it's done, so a burst of requests for a
+  // cold file opens and maps it once. nullptr if it can't be built or the
+  // waiting coroutine is cancelled
+  Task<valueType> fetch(Key key) override {
+    std::shared_ptr<pendingBuild> pending;
+    bool building;
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      if (auto it = map.find(key); it != map.end()) {
+        touch(it->second);
+        co_return *it->second;
+      }
+      auto [it, inserted] = builds.try_emplace(key);
+      if (inserted) {
+        it->second = std::make_shared<pendingBuild>();
       }
-      // otherwise the key is in the head of the list
-      return *map[key];
+      pending = it->second;
+      building = inserted;
     }
 
-    // if the key is in the cache, move it to the head of the list
-    if (map[key] != cacheList.begin()) {
-      cacheList.splice(cacheList.begin(), cacheList, map[key]);
+    if (!building) {
+      if (!co_await pending->done.wait()) {
+        co_return nullptr;
+      }
+      co_return pending->value;
     }
 
-    // map[key] is the iterator pointing to the value
-    // return the value
-    // usually a shared_ptr
-    return *map[key];
+    // the build is ended on every way out, a build or an insert throwing
+    // leaves the waiters with nullptr rather than parked for good
+    buildEnd end{*this, key, *pending};
+    auto newNode = this->builder.build(key);
+    if (newNode != nullptr) {
+      std::unique_lock<std::mutex> lock(mtx);
+      pending->value = insert(key, std::move(newNode));
+    }
+    co_return pending->value;
   }
 
   // not thread safe
@@ -104,15 +145,7 @@ struct lruCache : public cacheBase<Key, ValueBuilder> {
       return false;
     }
 
-    if (map.size() == this->capacity) {
-      auto endNode = cacheList.back();
-      auto path = endNode->path();
-      map.erase(path);
-      cacheList.pop_back();
-    }
-
-    cacheList.push_front(newNode);
-    map[key] = cacheList.begin();
+    insert(key, std::move(newNode));
     return true;
   }
 
@@ -127,9 +160,60 @@ struct lruCache : public cacheBase<Key, ValueBuilder> {
   lruCache(int capacity) : cacheBase<Key, ValueBuilder>(capacity) {}
 
 private:
+  // a value being built by fetch()
+  struct pendingBuild {
+    asyncEvent done;
+    valueType value = nullptr;
+  };
+
+  // forget the build of the key and wake its waiters when destroyed,
+  // the waiters read the value after the event is set
+  struct buildEnd {
+    lruCache &cache;
+    Key const &key;
+    pendingBuild &pending;
+
+    ~buildEnd() {
+      {
+        std::unique_lock<std::mutex> lock(cache.mtx);
+        cache.builds.erase(key);
+      }
+      pending.done.set();
+    }
+  };
+
+  // move the node to the head of the list
+  void touch(iteratorType node) {
+    if (node != cacheList.begin()) {
+      cacheList.splice(cacheList.begin(), cacheList, node);
+    }
+  }
+
+  // not thread safe
+  // the key may have been inserted while its value was built,
+  // then the cached value is kept and returned
+  valueType insert(Key const &key, valueType newNode) {
+    if (auto it = map.find(key); it != map.end()) {
+      touch(it->second);
+      return *it->second;
+    }
+
+    if (map.size() == this->capacity) {
+      auto endNode = cacheList.back();
+      auto path = endNode->path();
+      map.erase(path);
+      cacheList.pop_back();
+    }
+
+    cacheList.push_front(std::move(newNode));
+    map[key] = cacheList.begin();
+    return cacheList.front();
+  }
+
   std::mutex mtx;
   cacheListType cacheList;
   iteratorMapType map;
+  std::unordered_map<Key, std::shared_ptr<pendingBuild>> builds;
 };
 
 // A factory to create caches with different policies
@@ -143,7 +227,7 @@ template <typename Key, typename ValueBuilder> struct cacheFactory {
       return std::make_unique<lruCache<Key, ValueBuilder>>(capacity);
     case policy::LFU:
     case policy::FIFO:
-      throw std::runtime_error("Not implemented yet");
+      throwException(std::runtime_error("Not implemented yet"));
     }
   }
 };
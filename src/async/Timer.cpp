@@ -1,26 +1,28 @@
 #include "async/Timer.hpp"
 
 #include "async/Tasks.hpp"
+#include "utils/Clock.hpp"
 
 #include <chrono>
 #include <print>
 
 namespace ACPAcoro {
 
-Task<> sleepUntil(std::chrono::system_clock::time_point time,
+Task<> sleepUntil(std::chrono::steady_clock::time_point time,
                   std::coroutine_handle<> coro) {
-  co_await timerAwaiter{coro, time};
+  co_await timerAwaiter{time};
+  if (coro)
+    coro.resume();
 }
 
-Task<> sleepFor(std::chrono::system_clock::duration duration,
+Task<> sleepFor(std::chrono::steady_clock::duration duration,
                 std::coroutine_handle<> coro) {
   // std::println("ready to sleep for {} seconds",
   //              std::chrono::duration_cast<std::chrono::seconds>(duration));
-  co_await timerAwaiter{co_await getSelfAwaiter{},
-                        std::chrono::system_clock::now() + duration};
+  co_await timerAwaiter{coarseClock::now() + duration};
   if (coro)
     coro.resume();
   // std::println("slept for {} seconds",
   //              std::chrono::duration_cast<std::chrono::seconds>(duration));
 }
-} // namespace ACPAcoro
\ No newline at end of file
+} // namespace ACPAcoro
@@ -1,7 +1,9 @@
 #include "http/Http.hpp"
 
+#include "http/HttpScan.hpp"
 #include "http/Socket.hpp"
 #include "tl/expected.hpp"
+#include "utils/Clock.hpp"
 
 #include <chrono>
 #include <expected>
@@ -17,7 +19,7 @@
 
 namespace ACPAcoro {
 
-tbb::concurrent_hash_map<int, std::shared_ptr<std::string>>
+tbb::concurrent_hash_map<int, std::shared_ptr<httpRequest::pendingRequest>>
     httpRequest::uncompletedRequests;
 
 bool httpRequest::checkMethod(std::string_view method) {
@@ -28,35 +30,40 @@ bool httpRequest::checkVersion(std::string_view version) {
   return version == "HTTP/1.1";
 }
 
-std::shared_ptr<std::string> httpRequest::getBuffer(int fd) {
+std::shared_ptr<httpRequest::pendingRequest>
+httpRequest::getPending(int fd) {
   decltype(uncompletedRequests)::accessor uncompletedRequestsAccessor;
   if (uncompletedRequests.find(uncompletedRequestsAccessor, fd)) {
     return uncompletedRequestsAccessor->second;
 
   } else {
-    auto buffer = std::make_shared<std::string>();
-    uncompletedRequests.emplace(fd, buffer);
-    return buffer;
+    auto pending = std::make_shared<pendingRequest>();
+    uncompletedRequests.emplace(fd, pending);
+    return pending;
   }
 }
 
-void httpRequest::eraseBuffer(int fd) { uncompletedRequests.erase(fd); }
+void httpRequest::erasePending(int fd) { uncompletedRequests.erase(fd); }
 
-// read the request message from the socket
-// when it read a uncompletedRequests
-// the process will be saved in a buffer
+// read the request head from the socket
+// the parser of the connection is fed each read, so a head split across
+// reads or followed by the next request is found where it ends.
+// an uncompleted head is saved with the parser until the socket is
+// readable again
 tl::expected<std::shared_ptr<std::string>, std::error_code>
 httpRequest::readRequest(reactorSocket &socket) {
   // std::println("Reading request message for socket {}", socket.fd);
   char buffer[1024];
-  auto requestMessage = getBuffer(socket.fd);
+  auto pending = getPending(socket.fd);
+  auto &requestMessage = pending->buffer;
+  auto &parser = pending->parser;
 
   // read loop
-  // until the read return a error_code
+  // until the head is completed or the read return a error_code
   // case 1)  EAGAIN
   // case 2)  EOF
   // case 3)  others
-  while (true) {
+  while (parser.status() == httpScan::headStatus::incomplete) {
 
     auto readResult =
         socket
@@ -66,113 +73,122 @@ httpRequest::readRequest(reactorSocket &socket) {
             .and_then([&](int bytesRead) -> tl::expected<int, std::error_code> {
               if (bytesRead == 0) {
                 return tl::unexpected(make_error_code(socketError::eofError));
-
-              } else if (bytesRead + requestMessage->size() > 4096) {
-                // if the request is too long
-                return tl::unexpected(make_error_code(httpErrc::BAD_REQUEST));
               }
-
               return bytesRead;
             })
 
-            // append the data to the requestMessage
+            // append the data to the requestMessage and parse it
             .map([&](int bytesRead) {
               requestMessage->append(buffer, bytesRead);
+              parser.feed({buffer, static_cast<std::size_t>(bytesRead)});
+              socket.timeouts.readProgress();
             });
 
     // handle the error
     // if the error is EWOULDBLOCK or EAGAIN,
-    // check if the request is completed
-    // if so, erase the buffer and return
-    // otherwise, return an error
+    // the head is uncompleted, wait for the next read
+    // otherwise, return the error
     if (!readResult) {
-      // in this three cases, check if the request is completed
       if (readResult.error() ==
               make_error_code(std::errc::resource_unavailable_try_again) ||
           readResult.error() ==
               make_error_code(std::errc::operation_would_block)) {
         // std::println("EWOULDBLOCK or EAGAIN");
-
-        // if so, return as Success
-        if (requestMessage->ends_with("\r\n\r\n")) {
-          eraseBuffer(socket.fd);
-          return requestMessage;
-        }
-        // otherwise, the requestMessage is uncompletedRequests
-        // return error
         return tl::unexpected(make_error_code(httpErrc::UNCOMPLETED_REQUEST));
 
       } else {
-        eraseBuffer(socket.fd);
+        erasePending(socket.fd);
         return tl::unexpected(readResult.error());
       }
     }
   }
+
+  // malformed or too long
+  if (parser.status() == httpScan::headStatus::malformed) {
+    erasePending(socket.fd);
+    return tl::unexpected(make_error_code(httpErrc::BAD_REQUEST));
+  }
+
+  // the head is split with the bounds of the parser before it moves on.
+  // the bytes past the head begin the next request, which may be complete
+  // already, the next call returns it without reading
+  auto head = std::move(requestMessage);
+  auto headSize = parser.headSize();
+  if (head->size() == headSize) {
+    parseResquest(head, parser);
+    erasePending(socket.fd);
+  } else {
+    requestMessage = std::make_shared<std::string>(head->substr(headSize));
+    head->resize(headSize);
+    parseResquest(head, parser);
+    parser.reset();
+    parser.feed(*requestMessage);
+  }
+  return head;
 }
 
 tl::expected<void, std::error_code>
-httpRequest::parseResquest(std::unique_ptr<std::string> requestMsg) {
+httpRequest::parseResquest(std::shared_ptr<std::string const> requestMsg) {
 
-  // std::println("Parsing request message for socket {}", socket.fd);
-
-  std::string_view request(*requestMsg);
+  buffer = std::move(requestMsg);
+  std::string_view request(*buffer);
 
   return this->parseFirstLine(request)
       .and_then([&]() -> tl::expected<void, std::error_code> {
         // parse the headers
         return parseHeaders(request);
       })
+      .and_then([&]() { return checkConnection(); });
+}
+
+// the bounds were checked as the parser framed the head, only the
+// method, the version and the whitespace around the values are looked at
+tl::expected<void, std::error_code>
+httpRequest::parseResquest(std::shared_ptr<std::string const> requestMsg,
+                           requestParser const &parser) {
+
+  buffer = std::move(requestMsg);
+  std::string_view request(*buffer);
+
+  return setFirstLine(request, parser.requestLine())
       .and_then([&]() -> tl::expected<void, std::error_code> {
-        if (this->headers.data.contains("Connection") &&
-            this->headers.data["Connection"] == "close") {
-          return tl::unexpected(make_error_code(socketError::eofError));
+        for (auto const &header : parser.headerLines()) {
+          headers.add(header.name.of(request),
+                      httpScan::trimValue(request, header.value).of(request));
         }
         return {};
-      });
+      })
+      .and_then([&]() { return checkConnection(); });
 }
 
+tl::expected<void, std::error_code> httpRequest::checkConnection() {
+  auto connection = headers.get("Connection");
+  if (connection && httpHeaders::equalsIgnoreCase(*connection, "close")) {
+    return tl::unexpected(make_error_code(socketError::eofError));
+  }
+  return {};
+}
+
+// the header lines up to the empty one ending the head,
+// the view is left after it
 tl::expected<void, std::error_code>
 httpRequest::parseHeaders(std::string_view &request) {
-  // std::println("Parsing headers:");
-  // std::print("Request: \n{}", request);
-  // fields are delimited by CRLF
-  size_t pos = request.find("\r\n");
-
-  while (pos != 0) {
-
-    if (pos == std::string_view::npos) {
-      status = httpErrc::BAD_REQUEST;
-      return tl::unexpected(make_error_code(httpErrc::BAD_REQUEST));
-    }
-    // get header line
-    std::string_view headerLine = request.substr(0, pos);
-    request.remove_prefix(pos + 2);
-
-    // parse the header line
-    // get key
-    pos = headerLine.find(':');
-    // check if the header line is valid
-    // unvalid case:
-    // 1) no colon in the header line
-    // 2) colon is the first character
-    if (pos == std::string_view::npos || pos == 0) {
-      status = httpErrc::BAD_REQUEST;
-      return tl::unexpected(make_error_code(httpErrc::BAD_REQUEST));
-    }
-    std::string_view key = headerLine.substr(0, pos);
+  httpScan::headerIndex index;
+  if (httpScan::indexHeaders(request, index) !=
+      httpScan::headStatus::complete) {
+    status = httpErrc::BAD_REQUEST;
+    return tl::unexpected(make_error_code(httpErrc::BAD_REQUEST));
+  }
 
-    // split the key and value
-    headerLine.remove_prefix(pos + 1);
-    // get value
-    if (headerLine.empty()) {
+  for (auto line : index.view()) {
+    httpScan::headerLine header;
+    if (!httpScan::scanHeaderLine(request, line, header)) {
       status = httpErrc::BAD_REQUEST;
       return tl::unexpected(make_error_code(httpErrc::BAD_REQUEST));
     }
-    std::string_view value = headerLine;
-    headers.data.emplace(key, value);
-
-    pos = request.find("\r\n");
+    headers.add(header.name.of(request), header.value.of(request));
   }
+  request.remove_prefix(index.size);
   return {};
 }
 
@@ -180,62 +196,34 @@ tl::expected<void, std::error_code>
 httpRequest::parseFirstLine(std::string_view &request) {
 
   this->status = httpMessage::statusCode::OK;
-  // find the end of the request line
-  size_t pos = request.find("\r\n");
-  if (pos == std::string_view::npos) {
-    // std::println("failed to parse in first phase");
-    status = httpErrc::BAD_REQUEST;
-    return tl::unexpected(make_error_code(httpErrc::BAD_REQUEST));
-  }
-  std::string_view requestLine = request.substr(0, pos);
-  // std::println("Request line: {}", requestLine);
 
-  // remove the request line from the view
-  request.remove_prefix(pos + 2);
-
-  // parse the request line
-  pos = requestLine.find(' ');
-  if (pos == std::string_view::npos) {
-    // std::println("failed to parse in second phase");
+  httpScan::requestLine line;
+  auto pos = httpScan::scanRequestLine(request, line);
+  if (pos == httpScan::npos) {
     status = httpErrc::BAD_REQUEST;
     return tl::unexpected(make_error_code(httpErrc::BAD_REQUEST));
   }
-  std::string_view method = requestLine.substr(0, pos);
-  // std::println("Method: {}", method);
 
-  if (!checkMethod(method)) {
-    // std::println("failed to parse in third phase");
-    status = httpErrc::BAD_REQUEST;
-    return tl::unexpected(make_error_code(httpErrc::BAD_REQUEST));
-  }
-
-  requestLine.remove_prefix(pos + 1);
-  // parse the uri
-  pos = requestLine.find(' ');
-  if (pos == std::string_view::npos) {
-    // std::println("failed to parse in fourth phase");
-    status = httpErrc::BAD_REQUEST;
-    return tl::unexpected(make_error_code(httpErrc::BAD_REQUEST));
-  }
-  std::string_view uri = requestLine.substr(0, pos);
-
-  requestLine.remove_prefix(pos + 1);
+  // remove the request line from the view
+  return setFirstLine(request, line).map([&] { request.remove_prefix(pos); });
+}
 
-  // parse the version
-  std::string_view version = requestLine;
+tl::expected<void, std::error_code>
+httpRequest::setFirstLine(std::string_view request,
+                          httpScan::requestLine const &line) {
 
-  // std::println("Version: {}", version);
+  this->status = httpMessage::statusCode::OK;
 
-  if (!checkVersion(version)) {
-    // std::println("failed to parse in fifth phase");
+  auto method = line.method.of(request);
+  auto version = line.version.of(request);
+  if (!checkMethod(method) || !checkVersion(version)) {
     status = httpErrc::BAD_REQUEST;
     return tl::unexpected(make_error_code(httpErrc::BAD_REQUEST));
   }
 
   this->method = methodStrings.at(method);
-  this->uri = std::move(uri);
-  this->version = std::move(version);
-  // std::println("Success to parse the firstline");
+  this->uri = line.target.of(request);
+  this->version = version;
   return {};
 }
 
@@ -283,8 +271,6 @@ httpResponse::httpResponse(httpRequest &request,
     }
   }
 
-  auto &requestHeaders = request.headers.data;
-
   if (uri.string().ends_with("/")) {
     uri /= "index.html";
   }
@@ -314,12 +300,13 @@ httpResponse::httpResponse(httpRequest &request,
   MIMEWildcardType.append("/*");
 
   // check if the client is able to accept this type of file
-  if (!requestHeaders.contains("Accept")) {
+  auto const accept = request.headers.get("Accept");
+  if (!accept) {
     status = httpMessage::statusCode::BAD_REQUEST;
     return;
   }
 
-  std::string_view const acceptedMIMEtypes = requestHeaders.at("Accept");
+  std::string_view const acceptedMIMEtypes = *accept;
   if (!acceptedMIMEtypes.find("*/*") &&
       !acceptedMIMEtypes.find(MIMEWildcardType) &&
       !acceptedMIMEtypes.find(MIMEfulltype)) {
@@ -333,8 +320,9 @@ httpResponse::httpResponse(httpRequest &request,
 
   uri = realPath;
 
-  headers.data.emplace("Content-Type", MIMEfulltype);
-  headers.data.emplace("Catch-Control", "no-cache");
+  // the MIME type is a view of the static extension map
+  headers.add("Content-Type", MIMEfulltype);
+  headers.add("Catch-Control", "no-cache");
 
   return;
 }
@@ -355,9 +343,9 @@ std::shared_ptr<std::string> httpResponse::serialize() {
     auto response = std::make_shared<std::string>();
     response->append(std::format("{} {} {}\r\n", version, (int)status,
                                  httpErrorCode().message((int)status)));
-    for (auto &headerLine : headers.data) {
-      response->append(
-          std::format("{}: {}\r\n", headerLine.first, headerLine.second));
+    response->append(std::format("Date: {}\r\n", httpDate()));
+    for (auto const &field : headers.fields()) {
+      response->append(std::format("{}: {}\r\n", field.name, field.value));
     }
     response->append("\r\n");
     return response;